@@ -0,0 +1,155 @@
+/*                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                      /*
+ MidiClockCtl : MIDI controller (Time Clock) with rotary encoder, 4 digit 7seg display and footswitches.
+ Copyright (C) 2013 Adrien Anselme
+
+ This file is part of MidiClockCtl.
+
+ MidiClockCtl is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 2 of the License, or
+ (at your option) any later version.
+
+ MidiClockCtl is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with MidiClockCtl.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef _MIDI_CLOCK_CTL_HOST_ARDUINO_H_
+#define _MIDI_CLOCK_CTL_HOST_ARDUINO_H_
+
+// Minimal Arduino core for building the firmware modules on a PC.
+// Timer1 registers are plain variables read by the host backend,
+// "interrupts" are a lock shared with the thread running the ISRs.
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <math.h>
+#include "binary.h"
+#include "avr/pgmspace.h"
+
+typedef uint8_t byte;
+typedef bool boolean;
+
+#define HIGH 0x1
+#define LOW  0x0
+
+#define INPUT 0x0
+#define OUTPUT 0x1
+#define INPUT_PULLUP 0x2
+
+#define CHANGE 1
+#define FALLING 2
+#define RISING 3
+
+#define LSBFIRST 0
+#define MSBFIRST 1
+
+#define A0 14
+#define A1 15
+#define A2 16
+#define A3 17
+#define A4 18
+#define A5 19
+
+#define min(a,b) ((a)<(b)?(a):(b))
+#define max(a,b) ((a)>(b)?(a):(b))
+#define constrain(amt,low,high) ((amt)<(low)?(low):((amt)>(high)?(high):(amt)))
+
+/////////////////////////////////////
+// Interrupts
+void hostLockInterrupts();
+void hostUnlockInterrupts();
+#define noInterrupts() hostLockInterrupts()
+#define interrupts() hostUnlockInterrupts()
+
+#define ISR(vector, ...) extern "C" void vector(void)
+#define TIMER1_COMPA_vect hostTimer1CompaVect
+extern "C" void TIMER1_COMPA_vect(void);
+// Compare B (clock + MTC timeline) is not emulated by the host timer
+#define TIMER1_COMPB_vect hostTimer1CompbVect
+extern "C" void TIMER1_COMPB_vect(void);
+
+/////////////////////////////////////
+// Timer1 (see ATmega328 datasheet)
+extern volatile uint8_t TCCR1A;
+extern volatile uint8_t TCCR1B;
+extern volatile uint8_t TIMSK1;
+extern volatile uint16_t TCNT1;
+extern volatile uint16_t OCR1A;
+extern volatile uint16_t OCR1B;
+extern volatile uint8_t TIFR1;
+
+#define CS10 0
+#define CS11 1
+#define CS12 2
+#define WGM12 3
+#define OCIE1A 1
+#define OCIE1B 2
+#define OCF1A 1
+#define OCF1B 2
+
+/////////////////////////////////////
+// Digital pins: 8 pins per port, levels kept in memory
+#define HOST_NUM_PORTS 3
+
+extern volatile uint8_t hostPorts[HOST_NUM_PORTS];
+
+#define digitalPinToPort(pin) ((pin) / 8)
+#define digitalPinToBitMask(pin) (1 << ((pin) % 8))
+#define portOutputRegister(port) (&hostPorts[(port)])
+
+void pinMode(uint8_t pin, uint8_t mode);
+void digitalWrite(uint8_t pin, uint8_t value);
+int digitalRead(uint8_t pin);
+
+/// Sets the level an input pin will read, e.g. to simulate a switch
+void hostSetInput(uint8_t pin, uint8_t level);
+
+/////////////////////////////////////
+// External interrupts (INT0 on pin 2, INT1 on pin 3)
+#define HOST_NUM_EXT_INTERRUPTS 2
+
+// Enable bits are kept but not checked: the host program calls the handlers
+extern volatile uint8_t EIMSK;
+#define INT0 0
+#define INT1 1
+
+void attachInterrupt(uint8_t interrupt, void (*handler)(void), int mode);
+/// Handler attached to an external interrupt, or 0. Up to the host program to call it.
+void (*hostInterruptHandler(uint8_t interrupt))(void);
+
+/////////////////////////////////////
+// Time
+unsigned long millis();
+unsigned long micros();
+void delay(unsigned long ms);
+
+/////////////////////////////////////
+// Serial output goes to a file descriptor (file, pipe or raw MIDI device)
+class HardwareSerial
+{
+public:
+  HardwareSerial();
+
+  void begin(unsigned long baud);
+  void setOutput(int fd);
+  size_t write(uint8_t data);
+  size_t write(const uint8_t * data, size_t length);
+  int available();
+  int read();
+
+  /// Called for every byte written, e.g. to timestamp it
+  void setWriteHook(void (*hook)(uint8_t data));
+
+private:
+  int mFd;
+  void (*mWriteHook)(uint8_t data);
+};
+
+extern HardwareSerial Serial;
+
+#endif
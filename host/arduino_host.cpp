@@ -0,0 +1,193 @@
+/*                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                      /*
+ MidiClockCtl : MIDI controller (Time Clock) with rotary encoder, 4 digit 7seg display and footswitches.
+ Copyright (C) 2013 Adrien Anselme
+
+ This file is part of MidiClockCtl.
+
+ MidiClockCtl is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 2 of the License, or
+ (at your option) any later version.
+
+ MidiClockCtl is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with MidiClockCtl.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <errno.h>
+#include "Arduino.h"
+
+///////////////////////////////////// Interrupts
+static pthread_mutex_t gInterruptLock;
+static pthread_once_t gInterruptLockOnce = PTHREAD_ONCE_INIT;
+
+static void initInterruptLock()
+{
+  // Recursive: an ISR may itself use noInterrupts()/interrupts() pairs
+  pthread_mutexattr_t attr;
+  pthread_mutexattr_init(&attr);
+  pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+  pthread_mutex_init(&gInterruptLock, &attr);
+  pthread_mutexattr_destroy(&attr);
+}
+
+void hostLockInterrupts()
+{
+  pthread_once(&gInterruptLockOnce, initInterruptLock);
+  pthread_mutex_lock(&gInterruptLock);
+}
+
+void hostUnlockInterrupts()
+{
+  pthread_mutex_unlock(&gInterruptLock);
+}
+
+///////////////////////////////////// Timer1
+volatile uint8_t TCCR1A = 0;
+volatile uint8_t TCCR1B = 0;
+volatile uint8_t TIMSK1 = 0;
+volatile uint16_t TCNT1 = 0;
+volatile uint16_t OCR1A = 0;
+volatile uint16_t OCR1B = 0;
+volatile uint8_t TIFR1 = 0;
+
+///////////////////////////////////// Digital pins
+volatile uint8_t hostPorts[HOST_NUM_PORTS] = { 0 };
+
+void pinMode(uint8_t pin, uint8_t mode)
+{
+}
+
+void digitalWrite(uint8_t pin, uint8_t value)
+{
+  noInterrupts();
+  if( value == LOW )
+    *portOutputRegister(digitalPinToPort(pin)) &= ~digitalPinToBitMask(pin);
+  else
+    *portOutputRegister(digitalPinToPort(pin)) |= digitalPinToBitMask(pin);
+  interrupts();
+}
+
+int digitalRead(uint8_t pin)
+{
+  return (*portOutputRegister(digitalPinToPort(pin)) & digitalPinToBitMask(pin)) ? HIGH : LOW;
+}
+
+void hostSetInput(uint8_t pin, uint8_t level)
+{
+  digitalWrite(pin, level);
+}
+
+///////////////////////////////////// External interrupts
+static void (*gInterruptHandlers[HOST_NUM_EXT_INTERRUPTS])(void) = { 0 };
+
+volatile uint8_t EIMSK = 0;
+
+void attachInterrupt(uint8_t interrupt, void (*handler)(void), int mode)
+{
+  if( interrupt < HOST_NUM_EXT_INTERRUPTS )
+  {
+    gInterruptHandlers[interrupt] = handler;
+    EIMSK |= 1 << interrupt;
+  }
+}
+
+void (*hostInterruptHandler(uint8_t interrupt))(void)
+{
+  return (interrupt < HOST_NUM_EXT_INTERRUPTS) ? gInterruptHandlers[interrupt] : 0;
+}
+
+///////////////////////////////////// Time
+static unsigned long long nowMicros()
+{
+  static unsigned long long start = 0;
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  const unsigned long long now = ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+  if( start == 0 )
+    start = now;
+  return now - start;
+}
+
+unsigned long millis()
+{
+  return nowMicros() / 1000;
+}
+
+unsigned long micros()
+{
+  return nowMicros();
+}
+
+void delay(unsigned long ms)
+{
+  usleep(ms * 1000);
+}
+
+///////////////////////////////////// Serial
+HardwareSerial Serial;
+
+HardwareSerial::HardwareSerial()
+: mFd(-1), mWriteHook(0)
+{
+}
+
+void HardwareSerial::begin(unsigned long baud)
+{
+  // Nothing to configure, the output decides of the rate
+}
+
+void HardwareSerial::setOutput(int fd)
+{
+  mFd = fd;
+}
+
+void HardwareSerial::setWriteHook(void (*hook)(uint8_t data))
+{
+  mWriteHook = hook;
+}
+
+size_t HardwareSerial::write(uint8_t data)
+{
+  return write(&data, 1);
+}
+
+size_t HardwareSerial::write(const uint8_t * data, size_t length)
+{
+  if( mWriteHook )
+  {
+    for( size_t i = 0; i < length; ++i )
+      mWriteHook(data[i]);
+  }
+  
+  if( mFd < 0 )
+    return length;
+
+  size_t written = 0;
+  while( written < length )
+  {
+    const ssize_t n = ::write(mFd, data + written, length - written);
+    if( n < 0 && errno == EINTR )
+      continue;
+    if( n <= 0 )
+      break;
+    written += n;
+  }
+  return written;
+}
+
+int HardwareSerial::available()
+{
+  return 0;
+}
+
+int HardwareSerial::read()
+{
+  return -1;
+}
@@ -0,0 +1,28 @@
+/*                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                      /*
+ MidiClockCtl : MIDI controller (Time Clock) with rotary encoder, 4 digit 7seg display and footswitches.
+ Copyright (C) 2013 Adrien Anselme
+
+ This file is part of MidiClockCtl.
+
+ MidiClockCtl is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 2 of the License, or
+ (at your option) any later version.
+
+ MidiClockCtl is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with MidiClockCtl.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef _MIDI_CLOCK_CTL_HOST_PGMSPACE_H_
+#define _MIDI_CLOCK_CTL_HOST_PGMSPACE_H_
+
+// No separate flash address space on a PC
+#define PROGMEM
+#define pgm_read_byte(address) (*(const uint8_t *)(address))
+#define pgm_read_word(address) (*(const uint16_t *)(address))
+
+#endif
@@ -0,0 +1,62 @@
+/*                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                      /*
+ MidiClockCtl : MIDI controller (Time Clock) with rotary encoder, 4 digit 7seg display and footswitches.
+ Copyright (C) 2013 Adrien Anselme
+
+ This file is part of MidiClockCtl.
+
+ MidiClockCtl is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 2 of the License, or
+ (at your option) any later version.
+
+ MidiClockCtl is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with MidiClockCtl.  If not, see <http://www.gnu.org/licenses/>.
+*/
+/* Binary constants of the Arduino core (binary.h) used by the firmware:
+   add any new one here */
+#ifndef _MIDI_CLOCK_CTL_HOST_BINARY_H_
+#define _MIDI_CLOCK_CTL_HOST_BINARY_H_
+
+#define B0000 0
+#define B0010 2
+#define B0100 4
+#define B0110 6
+#define B00000000 0
+#define B00000001 1
+#define B00010000 16
+#define B00011100 28
+#define B00011110 30
+#define B00100000 32
+#define B00101010 42
+#define B00111110 62
+#define B01000000 64
+#define B01100000 96
+#define B01100110 102
+#define B01101110 110
+#define B01110000 112
+#define B01111010 122
+#define B01111100 124
+#define B10000000 128
+#define B10001100 140
+#define B10001110 142
+#define B10011100 156
+#define B10011110 158
+#define B10110110 182
+#define B10111110 190
+#define B11001110 206
+#define B11011010 218
+#define B11100000 224
+#define B11100110 230
+#define B11101100 236
+#define B11101110 238
+#define B11110010 242
+#define B11110110 246
+#define B11111100 252
+#define B11111110 254
+
+#endif
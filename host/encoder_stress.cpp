@@ -0,0 +1,343 @@
+/*                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                      /*
+ MidiClockCtl : MIDI controller (Time Clock) with rotary encoder, 4 digit 7seg display and footswitches.
+ Copyright (C) 2013 Adrien Anselme
+
+ This file is part of MidiClockCtl.
+
+ MidiClockCtl is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 2 of the License, or
+ (at your option) any later version.
+
+ MidiClockCtl is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with MidiClockCtl.  If not, see <http://www.gnu.org/licenses/>.
+*/
+/*
+ Feeds Encoder::doEncoder with synthesized quadrature waveforms, with contact
+ bounce, rotation speed and interrupt latency, and counts missed, extra and
+ reversed detents. Without a fixed rate, sweeps rotation speeds to find the
+ fastest one decoded without errors.
+
+ Interrupts are modelled like on the ATmega328: one flag per INT pin, set by
+ any change while it isn't already set, serviced after a random latency
+ (other interrupts, e.g. the clock) once the CPU is free. INT0 wins when both
+ are pending, and the handler reads both pins when it starts.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <vector>
+#include <algorithm>
+#include "Arduino.h"
+#include "../midi_clock_ctl/encoder.h"
+
+#define ENCODER_PIN_A 2
+#define ENCODER_PIN_B 3
+#define ENCODER_MIDDLE_VALUE 30000
+
+/////////////////////////////////////
+struct StressConfig
+{
+  unsigned long detents;     // per direction
+  double bounceUs;           // bounce window after each edge
+  int maxBounces;            // extra level changes per edge, drawn in 0..maxBounces
+  double maxLatencyUs;       // interrupt service delay drawn in 0..maxLatencyUs
+  double isrDurationUs;      // time the CPU spends in the handler
+  unsigned long seed;
+};
+
+struct StressResult
+{
+  unsigned long detents;
+  unsigned long missed;
+  unsigned long extra;
+  unsigned long reversed;
+  
+  unsigned long errors() const { return missed + extra + reversed; }
+};
+
+/////////////////////////////////////
+// Encoder contact waveforms and interrupt servicing, in simulated time
+class EncoderSimulator
+{
+public:
+  EncoderSimulator(const StressConfig & config);
+
+  StressResult run(const double detentsPerSecond);
+
+private:
+  struct Transition
+  {
+    double time;
+    byte pin;   // 0 for A, 1 for B
+    byte level;
+    bool operator<(const Transition & other) const { return time < other.time; }
+  };
+
+  void buildWaveform(const double detentsPerSecond, const bool clockwise, const double startTime);
+  void addEdge(const double time, const byte pin, const byte level, const double bounceWindow);
+  void simulateUntil(const double endTime);
+  void serviceInterrupt(const byte interrupt, const double time);
+  double random();
+
+private:
+  const StressConfig mConfig;
+  unsigned long mRandomState;
+  std::vector<Transition> mTransitions;
+  size_t mNextTransition;
+  byte mLevels[2];
+  bool mFlagSet[2];
+  double mFlagServiceTime[2];
+  double mCpuFreeTime;
+};
+
+EncoderSimulator::EncoderSimulator(const StressConfig & config)
+: mConfig(config), mRandomState(config.seed ? config.seed : 1), mNextTransition(0), mCpuFreeTime(0.0)
+{
+}
+
+double EncoderSimulator::random()
+{
+  // xorshift, reproducible for a given seed
+  mRandomState ^= mRandomState << 13;
+  mRandomState ^= mRandomState >> 7;
+  mRandomState ^= mRandomState << 17;
+  return (mRandomState & 0xFFFFFF) / double(0x1000000);
+}
+
+// Final level is reached at time, then the contact chatters within the window
+void EncoderSimulator::addEdge(const double time, const byte pin, const byte level, const double bounceWindow)
+{
+  Transition t = { time, pin, level };
+  mTransitions.push_back(t);
+
+  const int bounces = (mConfig.maxBounces > 0) ? int(random() * (mConfig.maxBounces + 1)) : 0;
+  std::vector<double> times;
+  for( int i = 0; i < 2 * bounces; ++i )
+    times.push_back(time + random() * bounceWindow);
+  std::sort(times.begin(), times.end());
+
+  for( size_t i = 0; i < times.size(); ++i )
+  {
+    // Back to the old level, then to the new one again
+    Transition b = { times[i], pin, byte((i % 2 == 0) ? !level : level) };
+    mTransitions.push_back(b);
+  }
+}
+
+// One detent is a full quadrature cycle starting and ending with both pins high.
+// Clockwise (increasing value) is A low first, counter-clockwise B low first.
+void EncoderSimulator::buildWaveform(const double detentsPerSecond, const bool clockwise, const double startTime)
+{
+  const double detentUs = 1e6 / detentsPerSecond;
+  const double edgeUs = detentUs / 4;
+  // Bounce has to settle before the next edge, or the waveform isn't quadrature anymore
+  const double bounceWindow = min(mConfig.bounceUs, edgeUs * 0.9);
+  const byte first = clockwise ? 0 : 1;
+  const byte second = clockwise ? 1 : 0;
+
+  for( unsigned long i = 0; i < mConfig.detents; ++i )
+  {
+    const double t = startTime + i * detentUs;
+    addEdge(t, first, LOW, bounceWindow);
+    addEdge(t + edgeUs, second, LOW, bounceWindow);
+    addEdge(t + 2 * edgeUs, first, HIGH, bounceWindow);
+    addEdge(t + 3 * edgeUs, second, HIGH, bounceWindow);
+  }
+}
+
+void EncoderSimulator::serviceInterrupt(const byte interrupt, const double time)
+{
+  // Hardware clears the flag when the handler starts
+  mFlagSet[interrupt] = false;
+  hostSetInput(ENCODER_PIN_A, mLevels[0]);
+  hostSetInput(ENCODER_PIN_B, mLevels[1]);
+
+  void (*handler)(void) = hostInterruptHandler(interrupt);
+  if( handler )
+    handler();
+
+  mCpuFreeTime = time + mConfig.isrDurationUs;
+}
+
+void EncoderSimulator::simulateUntil(const double endTime)
+{
+  while( true )
+  {
+    // Next interrupt to be serviced, INT0 first on a tie
+    int nextInterrupt = -1;
+    double nextServiceTime = 0.0;
+    for( int i = 0; i < 2; ++i )
+    {
+      if( !mFlagSet[i] )
+        continue;
+      const double serviceTime = max(mFlagServiceTime[i], mCpuFreeTime);
+      if( nextInterrupt < 0 || serviceTime < nextServiceTime )
+      {
+        nextInterrupt = i;
+        nextServiceTime = serviceTime;
+      }
+    }
+
+    const bool hasTransition = mNextTransition < mTransitions.size();
+    const double transitionTime = hasTransition ? mTransitions[mNextTransition].time : endTime;
+
+    if( nextInterrupt >= 0 && nextServiceTime <= transitionTime && nextServiceTime <= endTime )
+    {
+      serviceInterrupt(nextInterrupt, nextServiceTime);
+    }
+    else if( hasTransition && transitionTime <= endTime )
+    {
+      const Transition & t = mTransitions[mNextTransition++];
+      if( mLevels[t.pin] != t.level )
+      {
+        mLevels[t.pin] = t.level;
+        if( !mFlagSet[t.pin] )
+        {
+          mFlagSet[t.pin] = true;
+          mFlagServiceTime[t.pin] = t.time + random() * mConfig.maxLatencyUs;
+        }
+      }
+    }
+    else
+    {
+      return;
+    }
+  }
+}
+
+StressResult EncoderSimulator::run(const double detentsPerSecond)
+{
+  StressResult result;
+  memset(&result, 0, sizeof(result));
+
+  const double detentUs = 1e6 / detentsPerSecond;
+  // Each detent is checked once the following one starts, with some margin for pending interrupts
+  const double checkOffsetUs = detentUs + mConfig.maxLatencyUs + 2 * mConfig.isrDurationUs;
+
+  for( int direction = 0; direction < 2; ++direction )
+  {
+    const bool clockwise = (direction == 0);
+    const int expectedStep = clockwise ? 1 : -1;
+
+    Encoder encoder(ENCODER_PIN_B);
+    encoder.setup(0, 2 * ENCODER_MIDDLE_VALUE, ENCODER_MIDDLE_VALUE);
+    Encoder::setStep(1);
+    
+    mTransitions.clear();
+    mNextTransition = 0;
+    mLevels[0] = mLevels[1] = HIGH;
+    mFlagSet[0] = mFlagSet[1] = false;
+    mCpuFreeTime = 0.0;
+    hostSetInput(ENCODER_PIN_A, HIGH);
+    hostSetInput(ENCODER_PIN_B, HIGH);
+    
+    buildWaveform(detentsPerSecond, clockwise, 0.0);
+    std::stable_sort(mTransitions.begin(), mTransitions.end());
+
+    int lastValue = encoder.readValue();
+    for( unsigned long i = 0; i < mConfig.detents; ++i )
+    {
+      simulateUntil(i * detentUs + checkOffsetUs);
+      const int value = encoder.readValue();
+      const int step = (value - lastValue) * expectedStep;
+      lastValue = value;
+
+      ++result.detents;
+      if( step == 0 )
+        ++result.missed;
+      else if( step > 1 )
+        result.extra += step - 1;
+      else if( step < 0 )
+      {
+        result.reversed += -step;
+        ++result.missed;
+      }
+    }
+  }
+  return result;
+}
+
+/////////////////////////////////////
+static void printResult(const double rate, const StressResult & r)
+{
+  printf("%10.1f %9lu %8lu %8lu %9lu %8.3f%%\n", rate, r.detents, r.missed, r.extra, r.reversed,
+         100.0 * r.errors() / max(r.detents, 1UL));
+}
+
+static void usage(const char * name)
+{
+  fprintf(stderr,
+          "usage: %s [-n detents] [-b bounce_us] [-c max_bounces] [-l max_latency_us] [-i isr_us] [-r rate] [-s seed]\n"
+          "  -n  detents per direction and rate (default 2000)\n"
+          "  -b  bounce window after each edge (default 200)\n"
+          "  -c  max extra level changes per edge (default 4)\n"
+          "  -l  max interrupt latency, e.g. clock interrupt in progress (default 50)\n"
+          "  -i  time spent in the encoder interrupt (default 15, 2 digitalRead and a few ifs)\n"
+          "  -r  single rotation rate in detents/s, sweeps 5 to 2000 otherwise\n"
+          "  -s  random seed (default 1)\n", name);
+}
+
+int main(int argc, char ** argv)
+{
+  StressConfig config;
+  config.detents = 2000;
+  config.bounceUs = 200.0;
+  config.maxBounces = 4;
+  config.maxLatencyUs = 50.0;
+  config.isrDurationUs = 15.0;
+  config.seed = 1;
+  double rate = 0.0;
+
+  int opt;
+  while( (opt = getopt(argc, argv, "n:b:c:l:i:r:s:h")) != -1 )
+  {
+    switch( opt )
+    {
+      case 'n': config.detents = strtoul(optarg, NULL, 10); break;
+      case 'b': config.bounceUs = atof(optarg); break;
+      case 'c': config.maxBounces = atoi(optarg); break;
+      case 'l': config.maxLatencyUs = atof(optarg); break;
+      case 'i': config.isrDurationUs = atof(optarg); break;
+      case 'r': rate = atof(optarg); break;
+      case 's': config.seed = strtoul(optarg, NULL, 10); break;
+      default:
+        usage(argv[0]);
+        return 1;
+    }
+  }
+
+  printf("bounce %.0fus x%d, latency <= %.0fus, isr %.0fus\n",
+         config.bounceUs, config.maxBounces, config.maxLatencyUs, config.isrDurationUs);
+  printf("%10s %9s %8s %8s %9s %9s\n", "detents/s", "detents", "missed", "extra", "reversed", "errors");
+
+  if( rate > 0.0 )
+  {
+    EncoderSimulator simulator(config);
+    const StressResult result = simulator.run(rate);
+    printResult(rate, result);
+    return result.errors() ? 2 : 0;
+  }
+
+  // Sweep, about 12% steps
+  double maxCleanRate = 0.0;
+  bool clean = true;
+  for( double r = 5.0; r <= 2000.0; r *= 1.12 )
+  {
+    EncoderSimulator simulator(config);
+    const StressResult result = simulator.run(r);
+    printResult(r, result);
+    if( result.errors() == 0 && clean )
+      maxCleanRate = r;
+    else
+      clean = false;
+  }
+  printf("max rate without errors: %.1f detents/s\n", maxCleanRate);
+  return 0;
+}
@@ -0,0 +1,425 @@
+/*                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                      /*
+ MidiClockCtl : MIDI controller (Time Clock) with rotary encoder, 4 digit 7seg display and footswitches.
+ Copyright (C) 2013 Adrien Anselme
+
+ This file is part of MidiClockCtl.
+
+ MidiClockCtl is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 2 of the License, or
+ (at your option) any later version.
+
+ MidiClockCtl is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with MidiClockCtl.  If not, see <http://www.gnu.org/licenses/>.
+*/
+/*
+ Runs the MidiProxy clock and MTC engine as a Linux process, for rehearsals
+ without the hardware and as a timing reference for the AVR.
+
+ The Timer1 compare interrupt is emulated by a SCHED_FIFO thread sleeping
+ until absolute deadlines (clock_nanosleep), with the period read from the
+ Timer1 registers programmed by MidiProxy::setTimer. Bytes are written to a
+ file, a pipe or a raw MIDI device such as snd-virmidi's /dev/snd/midiC1D0.
+*/
+#include <pthread.h>
+#include <sched.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "Arduino.h"
+#include "../midi_clock_ctl/midi_proxy.h"
+
+#define NS_PER_TIMER_COUNT 62.5 // 16 MHz
+#define JITTER_HISTOGRAM_US 10000
+
+/////////////////////////////////////
+// Constant memory statistics over microsecond values
+class JitterStats
+{
+public:
+  JitterStats();
+
+  void add(const long long ns);
+  void print(const char * name) const;
+
+private:
+  const double percentile(const double p) const;
+
+private:
+  unsigned long mCount;
+  long long mMin;
+  long long mMax;
+  double mSum;
+  double mSumSquares;
+  unsigned long mHistogram[JITTER_HISTOGRAM_US + 1]; // 1 us bins on the absolute value, last one for overflow
+};
+
+JitterStats::JitterStats()
+: mCount(0), mMin(0), mMax(0), mSum(0.0), mSumSquares(0.0)
+{
+  memset(mHistogram, 0, sizeof(mHistogram));
+}
+
+void JitterStats::add(const long long ns)
+{
+  if( mCount == 0 || ns < mMin )
+    mMin = ns;
+  if( mCount == 0 || ns > mMax )
+    mMax = ns;
+  ++mCount;
+  mSum += ns;
+  mSumSquares += (double)ns * ns;
+
+  const long long us = llabs(ns) / 1000;
+  ++mHistogram[ min(us, (long long)JITTER_HISTOGRAM_US) ];
+}
+
+const double JitterStats::percentile(const double p) const
+{
+  const unsigned long target = p * mCount;
+  unsigned long seen = 0;
+  for( int i = 0; i <= JITTER_HISTOGRAM_US; ++i )
+  {
+    seen += mHistogram[i];
+    if( seen > target )
+      return i;
+  }
+  return JITTER_HISTOGRAM_US;
+}
+
+void JitterStats::print(const char * name) const
+{
+  if( mCount == 0 )
+  {
+    fprintf(stderr, "%s: no samples\n", name);
+    return;
+  }
+  const double mean = mSum / mCount;
+  const double stddev = sqrt(max(0.0, mSumSquares / mCount - mean * mean));
+  fprintf(stderr, "%s: n=%lu min=%.1fus mean=%.1fus stddev=%.1fus max=%.1fus |p50|<%.0fus |p99|<%.0fus |p99.9|<%.0fus\n",
+          name, mCount, mMin / 1000.0, mean / 1000.0, stddev / 1000.0, mMax / 1000.0,
+          percentile(0.5) + 1, percentile(0.99) + 1, percentile(0.999) + 1);
+}
+
+/////////////////////////////////////
+// Emulates the Timer1 compare match interrupt
+class Timer1Thread
+{
+public:
+  Timer1Thread();
+
+  bool start(const int priority);
+  void stop();
+
+  const JitterStats & wakeupStats() const;
+  const JitterStats & clockIntervalStats() const;
+  
+  /// Checks the interval between emitted clocks against the programmed period
+  void onByteWritten(const byte data);
+
+private:
+  static void * run(void * self);
+  void loop();
+  static long long periodNs(const unsigned int counts);
+  static long long timespecNs(const struct timespec & ts);
+
+private:
+  pthread_t mThread;
+  volatile bool mRunning;
+  JitterStats mWakeupStats;
+  JitterStats mClockIntervalStats;
+  long long mLastClockNs;
+  long long mExpectedIntervalNs;
+};
+
+Timer1Thread::Timer1Thread()
+: mThread(), mRunning(false), mLastClockNs(0), mExpectedIntervalNs(0)
+{
+}
+
+bool Timer1Thread::start(const int priority)
+{
+  pthread_attr_t attr;
+  pthread_attr_init(&attr);
+  
+  struct sched_param param;
+  memset(&param, 0, sizeof(param));
+  param.sched_priority = priority;
+  pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+  pthread_attr_setschedpolicy(&attr, SCHED_FIFO);
+  pthread_attr_setschedparam(&attr, &param);
+
+  mRunning = true;
+  int err = pthread_create(&mThread, &attr, run, this);
+  if( err != 0 )
+  {
+    // Typically EPERM without CAP_SYS_NICE / rtprio limit
+    fprintf(stderr, "SCHED_FIFO not available (%s), running with normal priority\n", strerror(err));
+    err = pthread_create(&mThread, NULL, run, this);
+  }
+  pthread_attr_destroy(&attr);
+  
+  if( err != 0 )
+    mRunning = false;
+  return err == 0;
+}
+
+void Timer1Thread::stop()
+{
+  if( !mRunning )
+    return;
+  mRunning = false;
+  pthread_join(mThread, NULL);
+}
+
+const JitterStats & Timer1Thread::wakeupStats() const
+{
+  return mWakeupStats;
+}
+
+const JitterStats & Timer1Thread::clockIntervalStats() const
+{
+  return mClockIntervalStats;
+}
+
+void * Timer1Thread::run(void * self)
+{
+  static_cast<Timer1Thread *>(self)->loop();
+  return NULL;
+}
+
+long long Timer1Thread::periodNs(const unsigned int counts)
+{
+  static const int prescalers[8] = { 0, 1, 8, 64, 256, 1024, 0, 0 };
+  return (long long)(counts * prescalers[TCCR1B & 0x07] * NS_PER_TIMER_COUNT);
+}
+
+long long Timer1Thread::timespecNs(const struct timespec & ts)
+{
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+void Timer1Thread::loop()
+{
+  struct timespec deadline;
+  clock_gettime(CLOCK_MONOTONIC, &deadline);
+  unsigned int nextCounts = 0;
+
+  while( mRunning )
+  {
+    noInterrupts();
+    if( nextCounts == 0 )
+      nextCounts = OCR1A + 1;
+    long long period = periodNs(nextCounts);
+    interrupts();
+
+    if( period <= 0 )
+      period = 1000000; // Timer stopped: poll every ms
+
+    long long next = timespecNs(deadline) + period;
+    deadline.tv_sec = next / 1000000000LL;
+    deadline.tv_nsec = next % 1000000000LL;
+    while( clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL) == EINTR )
+    {
+    }
+    
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    mWakeupStats.add(timespecNs(now) - next);
+
+    noInterrupts();
+    nextCounts = 0;
+    if( (TIMSK1 & (1 << OCIE1A)) && (TCCR1B & 0x07) )
+    {
+      mExpectedIntervalNs = periodNs(OCR1A + 1);
+      // Entering right after the compare match
+      TCNT1 = 0;
+      TIMER1_COMPA_vect();
+      // The ISR may have moved the counter (Start pre-roll)
+      if( TCNT1 != 0 )
+        nextCounts = OCR1A + 1 - TCNT1;
+    }
+    interrupts();
+  }
+}
+
+void Timer1Thread::onByteWritten(const byte data)
+{
+  if( data != 0xF8 )
+  {
+    // Transport or MTC: the clock grid may be shifted on purpose
+    if( data == 0xFA || data == 0xFB )
+      mLastClockNs = 0;
+    return;
+  }
+  
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  const long long nowNs = timespecNs(now);
+  if( mLastClockNs != 0 )
+    mClockIntervalStats.add(nowNs - mLastClockNs - mExpectedIntervalNs);
+  mLastClockNs = nowNs;
+}
+
+/////////////////////////////////////
+static Timer1Thread gTimer;
+static volatile sig_atomic_t gStopRequested = 0;
+
+static void onSignal(int)
+{
+  gStopRequested = 1;
+}
+
+// Timestamped copy of the output, see midi_analyze
+static FILE * gCapture = NULL;
+
+static void onByteWritten(uint8_t data)
+{
+  gTimer.onByteWritten(data);
+  if( gCapture )
+  {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    fprintf(gCapture, "%lld %02X\n", now.tv_sec * 1000000LL + now.tv_nsec / 1000, data);
+  }
+}
+
+static void usage(const char * name)
+{
+  fprintf(stderr,
+          "usage: %s [-m clock|mtc] [-b bpm] [-o output] [-c capture] [-d seconds] [-p preroll_us] [-r rtprio] [-s]\n"
+          "  -m  synchro mode (default clock)\n"
+          "  -b  tempo in clock mode (default 120)\n"
+          "  -o  file, pipe or raw MIDI device to write to, - for stdout (default)\n"
+          "  -c  also write each byte with its time to a file, for midi_analyze\n"
+          "  -d  run duration, 0 to run until interrupted (default 0)\n"
+          "  -p  pre-roll between Start and first clock (default 1000)\n"
+          "  -r  SCHED_FIFO priority of the timer thread (default 80)\n"
+          "  -s  send Start once running\n", name);
+}
+
+int main(int argc, char ** argv)
+{
+  MidiProxy::MidiSynchro mode = MidiProxy::SynchroClock;
+  float bpm = 120.0f;
+  const char * output = "-";
+  const char * capture = NULL;
+  unsigned long duration = 0;
+  unsigned long preroll = 1000;
+  int priority = 80;
+  bool sendStart = false;
+
+  int opt;
+  while( (opt = getopt(argc, argv, "m:b:o:c:d:p:r:sh")) != -1 )
+  {
+    switch( opt )
+    {
+      case 'm':
+        mode = (strcmp(optarg, "mtc") == 0) ? MidiProxy::SynchroMTC : MidiProxy::SynchroClock;
+        break;
+      case 'b':
+        bpm = atof(optarg);
+        break;
+      case 'o':
+        output = optarg;
+        break;
+      case 'c':
+        capture = optarg;
+        break;
+      case 'd':
+        duration = strtoul(optarg, NULL, 10);
+        break;
+      case 'p':
+        preroll = strtoul(optarg, NULL, 10);
+        break;
+      case 'r':
+        priority = atoi(optarg);
+        break;
+      case 's':
+        sendStart = true;
+        break;
+      default:
+        usage(argv[0]);
+        return 1;
+    }
+  }
+
+  int fd = STDOUT_FILENO;
+  if( strcmp(output, "-") != 0 )
+  {
+    fd = open(output, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if( fd < 0 )
+    {
+      perror(output);
+      return 1;
+    }
+  }
+  if( capture )
+  {
+    gCapture = fopen(capture, "w");
+    if( gCapture == NULL )
+    {
+      perror(capture);
+      return 1;
+    }
+  }
+  Serial.setOutput(fd);
+  Serial.setWriteHook(onByteWritten);
+
+  signal(SIGINT, onSignal);
+  signal(SIGTERM, onSignal);
+  // Avoid page faults in the timer thread
+  if( mlockall(MCL_CURRENT | MCL_FUTURE) != 0 )
+    perror("mlockall");
+
+  MidiProxy midi;
+  midi.setup();
+  midi.setStartPreroll(preroll);
+  if( mode == MidiProxy::SynchroClock )
+  {
+    midi.setModeClock();
+    midi.setBpm(bpm);
+  }
+  else
+    midi.setModeMTC();
+
+  if( !gTimer.start(priority) )
+  {
+    fprintf(stderr, "Could not start timer thread\n");
+    return 1;
+  }
+  if( sendStart )
+    midi.sendPlay();
+
+  const unsigned long startTime = millis();
+  while( !gStopRequested && (duration == 0 || millis() - startTime < duration * 1000) )
+  {
+    midi.update();
+    usleep(1000);
+  }
+
+  // Let the Stop go out on the next tick
+  midi.sendStop();
+  usleep(200000);
+  gTimer.stop();
+
+  gTimer.wakeupStats().print("timer wake-up latency");
+  if( mode == MidiProxy::SynchroClock )
+    gTimer.clockIntervalStats().print("clock interval error");
+
+  if( fd != STDOUT_FILENO )
+    close(fd);
+  if( gCapture )
+    fclose(gCapture);
+  return 0;
+}
@@ -0,0 +1,750 @@
+/*                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                      /*
+ MidiClockCtl : MIDI controller (Time Clock) with rotary encoder, 4 digit 7seg display and footswitches.
+ Copyright (C) 2013 Adrien Anselme
+
+ This file is part of MidiClockCtl.
+
+ MidiClockCtl is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 2 of the License, or
+ (at your option) any later version.
+
+ MidiClockCtl is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with MidiClockCtl.  If not, see <http://www.gnu.org/licenses/>.
+*/
+/*
+ Offline analysis of a timestamped capture of the box's MIDI output (e.g. from
+ a USB-MIDI interface). One line per byte or group of bytes:
+
+   <time> <byte> [<byte>...]
+
+ time in microseconds, or in seconds when it has a decimal point; bytes in
+ hexadecimal. Empty lines and lines starting with '#' are skipped.
+ The capture is streamed: memory use doesn't depend on its length.
+
+ Reports effective tempo and its error in ppm per steady tempo segment,
+ clock interval jitter percentiles, MTC quarter frame sequence and timecode
+ continuity, and the delay from Start / Continue to the first clock.
+*/
+#include <algorithm>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+#include "Arduino.h"
+#include "../midi_clock_ctl/midi_proxy.h"
+
+#define CLOCKS_PER_BEAT 24
+// Tempo changes are found on the mean interval over one beat
+#define CLOCK_WINDOW CLOCKS_PER_BEAT
+// Jitter reference: median of the intervals around, about a beat (odd)
+#define JITTER_MEDIAN_SPAN 25
+#define JITTER_HISTOGRAM_US 10000
+// Quarter frames further apart than this start a new MTC stream (stop, locate)
+#define MTC_GAP_US 100000.0
+#define MIDI_SYSEX_SIZE 16
+
+/////////////////////////////////////
+// Constant memory statistics over microsecond values
+class JitterStats
+{
+public:
+  JitterStats()
+  : mCount(0), mMin(0.0), mMax(0.0), mSum(0.0), mSumSquares(0.0)
+  {
+    memset(mHistogram, 0, sizeof(mHistogram));
+  }
+  
+  void add(const double us)
+  {
+    if( mCount == 0 || us < mMin )
+      mMin = us;
+    if( mCount == 0 || us > mMax )
+      mMax = us;
+    ++mCount;
+    mSum += us;
+    mSumSquares += us * us;
+    ++mHistogram[ static_cast<long>(fmin(fabs(us), JITTER_HISTOGRAM_US)) ];
+  }
+  
+  unsigned long count() const { return mCount; }
+  
+  void print(const char * name) const
+  {
+    if( mCount == 0 )
+    {
+      printf("%s: no samples\n", name);
+      return;
+    }
+    const double mean = mSum / mCount;
+    const double stddev = sqrt(fmax(0.0, mSumSquares / mCount - mean * mean));
+    printf("%s: n=%lu min=%.1fus mean=%.1fus stddev=%.1fus max=%.1fus\n"
+           "  |p50|<%.0fus |p90|<%.0fus |p99|<%.0fus |p99.9|<%.0fus\n",
+           name, mCount, mMin, mean, stddev, mMax,
+           percentile(0.5) + 1, percentile(0.9) + 1, percentile(0.99) + 1, percentile(0.999) + 1);
+  }
+  
+private:
+  double percentile(const double p) const
+  {
+    const unsigned long target = p * mCount;
+    unsigned long seen = 0;
+    for( int i = 0; i <= JITTER_HISTOGRAM_US; ++i )
+    {
+      seen += mHistogram[i];
+      if( seen > target )
+        return i;
+    }
+    return JITTER_HISTOGRAM_US;
+  }
+  
+private:
+  unsigned long mCount;
+  double mMin;
+  double mMax;
+  double mSum;
+  double mSumSquares;
+  unsigned long mHistogram[JITTER_HISTOGRAM_US + 1]; // 1 us bins on the absolute value, last one for overflow
+};
+
+/////////////////////////////////////
+// Interval minus the median of the intervals before and after it: follows
+// tempo changes without mixing both tempos in the reference. The first and
+// last half span of a run are not measured
+class IntervalJitter
+{
+public:
+  IntervalJitter() : mCount(0), mNext(0) {}
+  
+  void add(const double interval)
+  {
+    mIntervals[mNext] = interval;
+    mNext = (mNext + 1) % JITTER_MEDIAN_SPAN;
+    if( mCount < JITTER_MEDIAN_SPAN )
+      ++mCount;
+    if( mCount < JITTER_MEDIAN_SPAN )
+      return;
+    
+    double sorted[JITTER_MEDIAN_SPAN];
+    memcpy(sorted, mIntervals, sizeof(sorted));
+    std::nth_element(sorted, sorted + JITTER_MEDIAN_SPAN / 2, sorted + JITTER_MEDIAN_SPAN);
+    const double middle = mIntervals[(mNext + JITTER_MEDIAN_SPAN / 2) % JITTER_MEDIAN_SPAN];
+    mStats.add(middle - sorted[JITTER_MEDIAN_SPAN / 2]);
+  }
+  
+  /// Next intervals are not related to the previous ones
+  void restart()
+  {
+    mCount = 0;
+  }
+  
+  const JitterStats & stats() const { return mStats; }
+  
+private:
+  double mIntervals[JITTER_MEDIAN_SPAN];
+  int mCount;
+  int mNext;
+  JitterStats mStats;
+};
+
+/////////////////////////////////////
+// Clock tempo and jitter. Clocks go through a one beat window before being
+// added to the current segment: a segment ends when the window mean moves
+// away from the segment tempo (encoder, tap tempo). Start and Continue also
+// end a segment, as pre-roll moves the grid.
+class ClockAnalysis
+{
+public:
+  ClockAnalysis(const float nominalBpm, const double changePpm, const long minClocks, const bool quiet)
+  : mNominalBpm(nominalBpm), mChangePpm(changePpm), mMinClocks(minClocks), mQuiet(quiet),
+    mWindowCount(0), mWindowStart(0), mHasClock(false), mClockTime(0.0), mSegments(0), mListed(0), mListedSeconds(0.0), mWeightedPpm(0.0), mClocks(0)
+  {
+    resetSegment();
+  }
+  
+  void onClock(const double time)
+  {
+    ++mClocks;
+    if( mHasClock )
+      mJitter.add(time - mClockTime);
+    mHasClock = true;
+    mClockTime = time;
+    
+    if( mWindowCount == CLOCK_WINDOW )
+    {
+      const double oldest = mWindow[mWindowStart];
+      mWindowStart = (mWindowStart + 1) % CLOCK_WINDOW;
+      --mWindowCount;
+      
+      // Window mean over the intervals following the oldest one
+      const double windowPeriod = (time - oldest) / CLOCK_WINDOW;
+      if( mSegCount > CLOCK_WINDOW
+          && fabs(windowPeriod / segmentPeriod() - 1.0) * 1e6 > mChangePpm )
+      {
+        endSegment();
+      }
+      commit(oldest);
+    }
+    mWindow[(mWindowStart + mWindowCount) % CLOCK_WINDOW] = time;
+    ++mWindowCount;
+  }
+  
+  /// Start or Continue: clocks after it are on a new grid
+  void onRestart()
+  {
+    flush();
+    endSegment();
+    mJitter.restart();
+    mHasClock = false;
+  }
+  
+  void finish()
+  {
+    flush();
+    endSegment();
+  }
+  
+  void print() const
+  {
+    printf("clocks: %lu, %lu tempo segment(s), %lu of at least %ld clocks\n",
+           mClocks, mSegments, mListed, mMinClocks);
+    if( mListedSeconds > 0.0 )
+      printf("tempo error, weighted by duration: %+.1f ppm\n", mWeightedPpm / mListedSeconds);
+    mJitter.stats().print("clock interval jitter (against the median around)");
+  }
+  
+private:
+  void flush()
+  {
+    while( mWindowCount > 0 )
+    {
+      commit(mWindow[mWindowStart]);
+      mWindowStart = (mWindowStart + 1) % CLOCK_WINDOW;
+      --mWindowCount;
+    }
+  }
+  
+  void commit(const double time)
+  {
+    if( mSegCount == 0 )
+      mSegFirst = time;
+    mSegLast = time;
+    // Running means and co-moments of (index, time from segment start)
+    const double x = mSegCount;
+    const double y = time - mSegFirst;
+    ++mSegCount;
+    const double dx = x - mMeanX;
+    mMeanX += dx / mSegCount;
+    mMeanY += (y - mMeanY) / mSegCount;
+    mCxx += dx * (x - mMeanX);
+    mCxy += dx * (y - mMeanY);
+  }
+  
+  double segmentPeriod() const
+  {
+    return (mSegLast - mSegFirst) / (mSegCount - 1);
+  }
+  
+  void endSegment()
+  {
+    if( mSegCount > 1 )
+    {
+      ++mSegments;
+      // Least squares: jitter of single clocks doesn't move it much
+      const double period = mCxy / mCxx;
+      const double bpm = 60e6 / (CLOCKS_PER_BEAT * period);
+      // The box sets tempo in 0.1 BPM steps
+      const double nominal = (mNominalBpm > 0.0f) ? mNominalBpm : floor(bpm * 10.0 + 0.5) / 10.0;
+      const double ppm = (bpm / nominal - 1.0) * 1e6;
+      if( mSegCount >= mMinClocks )
+      {
+        ++mListed;
+        const double seconds = (mSegLast - mSegFirst) / 1e6;
+        mListedSeconds += seconds;
+        mWeightedPpm += ppm * seconds;
+        if( !mQuiet )
+          printf("%10.3f s  %8ld clocks over %9.3f s: %8.3f BPM, %+8.1f ppm against %.1f\n",
+                 mSegFirst / 1e6, mSegCount, seconds, bpm, ppm, nominal);
+      }
+    }
+    resetSegment();
+  }
+  
+  void resetSegment()
+  {
+    mSegCount = 0;
+    mSegFirst = mSegLast = 0.0;
+    mMeanX = mMeanY = mCxx = mCxy = 0.0;
+  }
+  
+private:
+  const float mNominalBpm;
+  const double mChangePpm;
+  const long mMinClocks;
+  const bool mQuiet;
+  
+  double mWindow[CLOCK_WINDOW];
+  int mWindowCount;
+  int mWindowStart;
+  bool mHasClock;       // Previous clock is on the same grid
+  double mClockTime;
+  
+  long mSegCount;
+  double mSegFirst;
+  double mSegLast;
+  double mMeanX, mMeanY, mCxx, mCxy;
+  
+  unsigned long mSegments;
+  unsigned long mListed;
+  double mListedSeconds;
+  double mWeightedPpm;
+  unsigned long mClocks;
+  IntervalJitter mJitter;
+};
+
+/////////////////////////////////////
+// Quarter frame sequence and timecode continuity
+class MtcAnalysis
+{
+public:
+  MtcAnalysis()
+  : mQuarterFrames(0), mFullFrames(0), mStreams(0), mSequenceErrors(0), mTimecodeJumps(0),
+    mRateChanges(0), mRate(-1), mExpectedPiece(-1), mPieces(0), mLastFrame(-1),
+    mLastTime(0.0), mStreamFirst(0.0), mStreamCount(0), mIntervals(0), mSeconds(0.0)
+  {
+    memset(mNibbles, 0, sizeof(mNibbles));
+  }
+  
+  void onQuarterFrame(const byte data, const double time)
+  {
+    if( mStreamCount == 0 || time - mLastTime > MTC_GAP_US )
+      startStream(time);
+    ++mQuarterFrames;
+    ++mStreamCount;
+    mLastTime = time;
+    
+    const int type = data & 0x70;
+    const int piece = type >> 4;
+    if( mExpectedPiece >= 0 && piece != mExpectedPiece )
+    {
+      ++mSequenceErrors;
+      // Timecode can't be compared across the error
+      mLastFrame = -1;
+      mPieces = 0;
+    }
+    mExpectedPiece = (piece + 1) & 0x07;
+    
+    if( type == MidiProxy::FramesLow )
+      mPieces = 0;
+    mNibbles[piece] = data & 0x0F;
+    mPieces |= 1 << piece;
+    if( type == MidiProxy::HoursHighAndSmpte && mPieces == 0xFF )
+      onTimecode();
+  }
+  
+  void onFullFrame(const byte hoursAndRate, const double time)
+  {
+    ++mFullFrames;
+    setRate((hoursAndRate >> 4) & MidiProxy::Frames30);
+    // Locate: the stream ends here, so the rate isn't measured across it.
+    // Quarter frames start a new one from the new position
+    endStream();
+    mLastTime = time;
+  }
+  
+  void finish()
+  {
+    endStream();
+  }
+  
+  void print() const
+  {
+    if( mQuarterFrames == 0 && mFullFrames == 0 )
+    {
+      printf("MTC: none\n");
+      return;
+    }
+    static const char * rateNames[4] = { "24", "25", "29.97 drop", "30" };
+    static const double nominalFps[4] = { 24.0, 25.0, 30000.0 / 1001.0, 30.0 };
+    printf("MTC: %lu quarter frames in %lu stream(s), %lu full frame(s), rate %s fps\n",
+           mQuarterFrames, mStreams, mFullFrames, (mRate >= 0) ? rateNames[mRate] : "unknown");
+    if( mSeconds > 0.0 && mRate >= 0 )
+    {
+      const double fps = mIntervals / mSeconds / 4.0;
+      printf("  measured %.4f fps, %+.1f ppm\n", fps, (fps / nominalFps[mRate] - 1.0) * 1e6);
+    }
+    printf("  sequence errors: %lu, timecode jumps: %lu, rate changes: %lu\n",
+           mSequenceErrors, mTimecodeJumps, mRateChanges);
+  }
+  
+private:
+  void startStream(const double time)
+  {
+    endStream();
+    ++mStreams;
+    mStreamFirst = time;
+    mStreamCount = 0;
+    mExpectedPiece = -1;
+    mPieces = 0;
+    mLastFrame = -1;
+  }
+  
+  void endStream()
+  {
+    if( mStreamCount > 1 )
+    {
+      mIntervals += mStreamCount - 1;
+      mSeconds += (mLastTime - mStreamFirst) / 1e6;
+    }
+    mStreamCount = 0;
+  }
+  
+  /// From the SMPTE type bits, as in the last quarter frame
+  void setRate(const byte smpte)
+  {
+    int rate = 3;
+    switch( smpte )
+    {
+      case MidiProxy::Frames24: rate = 0; break;
+      case MidiProxy::Frames25: rate = 1; break;
+      case MidiProxy::Frames30drop: rate = 2; break;
+    }
+    if( mRate >= 0 && rate != mRate )
+      ++mRateChanges;
+    mRate = rate;
+  }
+  
+  /// Complete sequence: timecode of the frame piece 0 was sent on,
+  /// two frames after the previous sequence
+  void onTimecode()
+  {
+    const int frames = mNibbles[0] | (mNibbles[1] << 4);
+    const int seconds = mNibbles[2] | (mNibbles[3] << 4);
+    const int minutes = mNibbles[4] | (mNibbles[5] << 4);
+    const int hours = mNibbles[6] | ((mNibbles[7] & 0x01) << 4);
+    setRate(mNibbles[7] & MidiProxy::Frames30);
+    
+    const long frame = toFrames(hours, minutes, seconds, frames);
+    if( mLastFrame >= 0 && frame != (mLastFrame + 2) % framesPerDay() )
+      ++mTimecodeJumps;
+    mLastFrame = frame;
+  }
+  
+  long toFrames(const int hours, const int minutes, const int seconds, const int frames) const
+  {
+    static const int labelFps[4] = { 24, 25, 30, 30 };
+    const long totalMinutes = hours * 60L + minutes;
+    long count = (totalMinutes * 60 + seconds) * labelFps[mRate] + frames;
+    // Drop frame: labels 0 and 1 skipped every minute but every tenth
+    if( mRate == 2 )
+      count -= 2 * (totalMinutes - totalMinutes / 10);
+    return count;
+  }
+  
+  long framesPerDay() const
+  {
+    return toFrames(24, 0, 0, 0);
+  }
+  
+private:
+  unsigned long mQuarterFrames;
+  unsigned long mFullFrames;
+  unsigned long mStreams;
+  unsigned long mSequenceErrors;
+  unsigned long mTimecodeJumps;
+  unsigned long mRateChanges;
+  int mRate;
+  int mExpectedPiece;
+  int mPieces;            // Bit mask of the pieces received since piece 0
+  byte mNibbles[8];
+  long mLastFrame;
+  double mLastTime;
+  double mStreamFirst;
+  unsigned long mStreamCount;
+  unsigned long mIntervals;
+  double mSeconds;
+};
+
+/////////////////////////////////////
+// Start / Continue to first clock (pre-roll, quantization doesn't show here)
+class TransportAnalysis
+{
+public:
+  TransportAnalysis()
+  : mStarts(0), mContinues(0), mStops(0), mSongPositions(0), mPending(false), mPendingTime(0.0) {}
+  
+  void onTransport(const byte type, const double time)
+  {
+    if( type == MidiProxy::Start )
+      ++mStarts;
+    else if( type == MidiProxy::Continue )
+      ++mContinues;
+    else if( type == MidiProxy::Stop )
+      ++mStops;
+    mPending = (type != MidiProxy::Stop);
+    mPendingTime = time;
+  }
+  
+  void onSongPosition()
+  {
+    ++mSongPositions;
+  }
+  
+  void onClock(const double time)
+  {
+    if( !mPending )
+      return;
+    mLatency.add(time - mPendingTime);
+    mPending = false;
+  }
+  
+  void print() const
+  {
+    printf("transport: %lu Start, %lu Continue, %lu Stop, %lu Song Position\n",
+           mStarts, mContinues, mStops, mSongPositions);
+    if( mLatency.count() > 0 )
+      mLatency.print("Start/Continue to first clock");
+  }
+  
+private:
+  unsigned long mStarts;
+  unsigned long mContinues;
+  unsigned long mStops;
+  unsigned long mSongPositions;
+  bool mPending;
+  double mPendingTime;
+  JitterStats mLatency;
+};
+
+/////////////////////////////////////
+// Splits the byte stream into messages (running status, real time bytes
+// anywhere), for the analyses
+class StreamParser
+{
+public:
+  StreamParser(ClockAnalysis & clock, MtcAnalysis & mtc, TransportAnalysis & transport)
+  : mClock(clock), mMtc(mtc), mTransport(transport),
+    mStatus(0), mExpected(0), mCount(0), mInSysex(false), mBytes(0) {}
+  
+  void parse(const byte data, const double time)
+  {
+    ++mBytes;
+    if( data >= MidiProxy::Clock )
+    {
+      if( data == MidiProxy::Clock )
+      {
+        mTransport.onClock(time);
+        mClock.onClock(time);
+      }
+      else if( data == MidiProxy::Start || data == MidiProxy::Continue || data == MidiProxy::Stop )
+      {
+        mTransport.onTransport(data, time);
+        if( data != MidiProxy::Stop )
+          mClock.onRestart();
+      }
+      return;
+    }
+    
+    if( data & 0x80 )
+    {
+      if( data == 0xF7 )
+      {
+        if( mInSysex && mCount < MIDI_SYSEX_SIZE )
+        {
+          mMessage[mCount++] = data;
+          onSysex(time);
+        }
+        mInSysex = false;
+        mStatus = 0;
+        return;
+      }
+      mInSysex = (data == MidiProxy::SystemExclusive);
+      mMessage[0] = data;
+      mCount = 1;
+      mStatus = mInSysex ? 0 : data;
+      mExpected = dataLength(data);
+      return;
+    }
+    
+    if( mInSysex )
+    {
+      if( mCount < MIDI_SYSEX_SIZE )
+        mMessage[mCount++] = data;
+      return;
+    }
+    if( mStatus == 0 )
+      return;
+    if( mCount == 0 )
+    {
+      // Running status
+      mMessage[0] = mStatus;
+      mCount = 1;
+    }
+    mMessage[mCount++] = data;
+    if( mCount > mExpected )
+    {
+      onMessage(time);
+      mCount = 0;
+      // System common messages don't support running status
+      if( mStatus >= 0xF0 )
+        mStatus = 0;
+    }
+  }
+  
+  unsigned long bytes() const { return mBytes; }
+  
+private:
+  void onMessage(const double time)
+  {
+    if( mMessage[0] == MidiProxy::TimeCodeQuarterFrame )
+      mMtc.onQuarterFrame(mMessage[1], time);
+    else if( mMessage[0] == MidiProxy::SongPosition )
+      mTransport.onSongPosition();
+  }
+  
+  // Full frame: F0 7F <device> 01 01 hr mn sc fr F7
+  void onSysex(const double time)
+  {
+    if( mCount == 10 && mMessage[1] == 0x7F && mMessage[3] == 0x01 && mMessage[4] == 0x01 )
+      mMtc.onFullFrame(mMessage[5], time);
+  }
+  
+  static byte dataLength(const byte status)
+  {
+    switch( status & 0xF0 )
+    {
+      case MidiProxy::ProgramChange:
+      case MidiProxy::AfterTouchChannel:
+        return 1;
+      case 0xF0:
+        if( status == MidiProxy::TimeCodeQuarterFrame || status == MidiProxy::SongSelect )
+          return 1;
+        return (status == MidiProxy::SongPosition) ? 2 : 0;
+      default:
+        return 2;
+    }
+  }
+  
+private:
+  ClockAnalysis & mClock;
+  MtcAnalysis & mMtc;
+  TransportAnalysis & mTransport;
+  byte mStatus;
+  byte mExpected;
+  byte mCount;
+  bool mInSysex;
+  byte mMessage[MIDI_SYSEX_SIZE];
+  unsigned long mBytes;
+};
+
+/////////////////////////////////////
+/// Parses one capture line. Returns false if it isn't valid
+static bool parseLine(char * line, StreamParser & parser, double & lastTime, unsigned long & backwards)
+{
+  char * token = strtok(line, " \t\r\n,;");
+  if( token == NULL || token[0] == '#' )
+    return true;
+  
+  char * end;
+  double time = strtod(token, &end);
+  if( *end != '\0' )
+    return false;
+  if( strchr(token, '.') != NULL )
+    time *= 1e6;
+  if( time < lastTime )
+    ++backwards;
+  lastTime = time;
+  
+  while( (token = strtok(NULL, " \t\r\n,;")) != NULL )
+  {
+    const unsigned long value = strtoul(token, &end, 16);
+    if( *end != '\0' || value > 0xFF )
+      return false;
+    parser.parse(value, time);
+  }
+  return true;
+}
+
+static void usage(const char * name)
+{
+  fprintf(stderr,
+          "usage: %s [-b bpm] [-c ppm] [-m clocks] [-q] [capture]\n"
+          "  -b  nominal tempo (default: nearest 0.1 BPM of each segment)\n"
+          "  -c  tempo change starting a new segment, ppm (default 10000)\n"
+          "  -m  shortest segment listed and counted in the tempo error, clocks (default 96)\n"
+          "  -q  summary only\n"
+          "Capture lines: <time> <byte> [<byte>...], time in us (or s with a decimal point),\n"
+          "bytes in hex. Reads standard input without a file or with -.\n", name);
+}
+
+int main(int argc, char ** argv)
+{
+  float nominalBpm = 0.0f;
+  double changePpm = 10000.0;
+  long minClocks = 96;
+  bool quiet = false;
+  
+  int opt;
+  while( (opt = getopt(argc, argv, "b:c:m:qh")) != -1 )
+  {
+    switch( opt )
+    {
+      case 'b': nominalBpm = atof(optarg); break;
+      case 'c': changePpm = atof(optarg); break;
+      case 'm': minClocks = atol(optarg); break;
+      case 'q': quiet = true; break;
+      default: usage(argv[0]); return 2;
+    }
+  }
+  
+  FILE * input = stdin;
+  const char * path = (optind < argc) ? argv[optind] : "-";
+  if( strcmp(path, "-") != 0 )
+  {
+    input = fopen(path, "r");
+    if( input == NULL )
+    {
+      perror(path);
+      return 1;
+    }
+  }
+  
+  // Large: keeps the histograms off the stack
+  static ClockAnalysis clock(nominalBpm, changePpm, minClocks, quiet);
+  static MtcAnalysis mtc;
+  static TransportAnalysis transport;
+  StreamParser parser(clock, mtc, transport);
+  
+  char line[512];
+  unsigned long lineNumber = 0;
+  unsigned long invalid = 0;
+  unsigned long backwards = 0;
+  double lastTime = -1e300;
+  while( fgets(line, sizeof(line), input) != NULL )
+  {
+    ++lineNumber;
+    if( !parseLine(line, parser, lastTime, backwards) && invalid++ == 0 )
+      fprintf(stderr, "%s:%lu: not a capture line, skipped\n", path, lineNumber);
+  }
+  if( input != stdin )
+    fclose(input);
+  clock.finish();
+  mtc.finish();
+  
+  printf("%lu bytes, %lu lines", parser.bytes(), lineNumber);
+  if( invalid > 0 )
+    printf(", %lu invalid", invalid);
+  if( backwards > 0 )
+    printf(", time went backwards %lu time(s)", backwards);
+  printf("\n");
+  clock.print();
+  mtc.print();
+  transport.print();
+  return (invalid > 0) ? 1 : 0;
+}
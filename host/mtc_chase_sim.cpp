@@ -0,0 +1,355 @@
+/*                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                      /*
+ MidiClockCtl : MIDI controller (Time Clock) with rotary encoder, 4 digit 7seg display and footswitches.
+ Copyright (C) 2013 Adrien Anselme
+
+ This file is part of MidiClockCtl.
+
+ MidiClockCtl is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 2 of the License, or
+ (at your option) any later version.
+
+ MidiClockCtl is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with MidiClockCtl.  If not, see <http://www.gnu.org/licenses/>.
+*/
+/*
+ Feeds MtcReader and MtcChase with synthesized MIDI Time Code, in simulated
+ time: quarter frames at a given rate and speed, delivered late by a random
+ main loop latency, with an optional dropout and an optional jump (full frame
+ then quarter frames from the new position). The MidiProxy clock runs on a
+ simulated Timer1, and every clock sent while playing is compared with the
+ song position the timecode asks for at that time.
+ Prints reader state changes, lock latency, timecode error and clock phase error.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+#include "Arduino.h"
+#include "../midi_clock_ctl/mtc_chase.h"
+#include "../midi_clock_ctl/midi_proxy.h"
+
+// Main loop period of the firmware, us
+#define SIM_LOOP_US 200
+#define SIM_CPU_FREQUENCY 16000000UL
+
+/////////////////////////////////////
+// Timecode source: real frame count <-> SMPTE labels
+class MtcSource
+{
+public:
+  MtcSource(const byte rate, const float speed)
+  : mRate(rate), mSpeed(speed), mStartFrame(0), mStartTime(0) {}
+  
+  float frameRate() const
+  {
+    static const float frameRates[4] = { 24.0f, 25.0f, 30000.0f / 1001.0f, 30.0f };
+    return frameRates[mRate];
+  }
+  
+  /// Playback from a frame count at a given time
+  void locate(const long frame, const double timeUs)
+  {
+    mStartFrame = frame;
+    mStartTime = timeUs;
+  }
+  
+  /// Position in frames at timeUs
+  double position(const double timeUs) const
+  {
+    return mStartFrame + (timeUs - mStartTime) * mSpeed * frameRate() / 1e6;
+  }
+  
+  /// Time of a quarter frame counted from the last locate
+  double quarterFrameTime(const long index) const
+  {
+    return mStartTime + index * 1e6 / (frameRate() * 4 * mSpeed);
+  }
+  
+  void toTimecode(long frame, byte & hours, byte & minutes, byte & seconds, byte & frames) const
+  {
+    static const byte labelRates[4] = { 24, 25, 30, 30 };
+    const int fps = labelRates[mRate];
+    if( mRate == 2 )
+    {
+      // Drop frame: add back the skipped labels
+      const long tenMinutes = frame / 17982;
+      long rest = frame % 17982;
+      frame += 18 * tenMinutes;
+      if( rest >= 2 )
+        frame += 2 * ((rest - 2) / 1798);
+    }
+    frames = frame % fps;
+    seconds = (frame / fps) % 60;
+    minutes = (frame / (fps * 60L)) % 60;
+    hours = frame / (fps * 3600L);
+  }
+  
+  /// Quarter frame data byte for a quarter frame count since frame 0
+  byte quarterFrame(const long index) const
+  {
+    byte hours, minutes, seconds, frames;
+    // All 8 pieces describe the frame the sequence started on
+    toTimecode((index - (index & 7)) / 4, hours, minutes, seconds, frames);
+    const byte piece = index & 7;
+    byte value = 0;
+    switch( piece )
+    {
+      case 0: value = frames & 0x0F; break;
+      case 1: value = frames >> 4; break;
+      case 2: value = seconds & 0x0F; break;
+      case 3: value = seconds >> 4; break;
+      case 4: value = minutes & 0x0F; break;
+      case 5: value = minutes >> 4; break;
+      case 6: value = hours & 0x0F; break;
+      case 7: value = (hours >> 4) | (mRate << 1); break;
+    }
+    return (piece << 4) | value;
+  }
+  
+  byte rate() const { return mRate; }
+  
+private:
+  byte mRate;
+  float mSpeed;
+  long mStartFrame;
+  double mStartTime;
+};
+
+/////////////////////////////////////
+// Timer1 in CTC mode, counting at the prescaled CPU clock
+static double gTimerCounts = 0.0;
+
+static void advanceTimer(const double us)
+{
+  static const int prescalers[8] = { 0, 1, 8, 64, 256, 1024, 0, 0 };
+  const int prescaler = prescalers[TCCR1B & 0x07];
+  if( prescaler == 0 )
+    return;
+  
+  gTimerCounts += us * (SIM_CPU_FREQUENCY / 1e6) / prescaler;
+  while( gTimerCounts >= 1.0 )
+  {
+    // Whole counts up to the next compare match
+    const double toMatch = OCR1A - TCNT1 + 1;
+    if( gTimerCounts < toMatch )
+    {
+      TCNT1 += static_cast<uint16_t>(gTimerCounts);
+      gTimerCounts -= floor(gTimerCounts);
+      break;
+    }
+    gTimerCounts -= toMatch;
+    TCNT1 = 0;
+    MidiProxy::doTimerTick();
+  }
+}
+
+/////////////////////////////////////
+// Clocks sent while playing, checked against the timecode
+static double gNow = 0.0;
+static const MtcSource * gSource = 0;
+static long gStartFrame = 0;
+static float gBpm = 120.0f;
+static bool gPlaying = false;
+static long gSongClock = 0;
+static byte gLastStatus = 0;
+static byte gData[2];
+static byte gDataCount = 0;
+static double gSettleUntil = 0.0;
+static double gSumError = 0.0;
+static double gMaxError = 0.0;
+static long gErrorCount = 0;
+static int gStarts = 0;
+
+static void onOutput(uint8_t data)
+{
+  if( data == 0xF8 )
+  {
+    if( !gPlaying )
+      return;
+    // Clock the timecode asks for now, against the one sent
+    const double frames = gSource->position(gNow) - gStartFrame;
+    const double wanted = frames / gSource->frameRate() * gBpm * 24 / 60;
+    const double errorMs = (gSongClock - wanted) * 60000.0 / (gBpm * 24);
+    if( gNow >= gSettleUntil )
+    {
+      gSumError += fabs(errorMs);
+      gMaxError = fmax(gMaxError, fabs(errorMs));
+      ++gErrorCount;
+    }
+    ++gSongClock;
+    return;
+  }
+  if( data == 0xFB || data == 0xFA )
+  {
+    gPlaying = true;
+    ++gStarts;
+    if( data == 0xFA )
+      gSongClock = 0;
+    printf("%9.3f s  %s at clock %ld\n", gNow / 1e6, data == 0xFA ? "start" : "continue", gSongClock);
+    gSettleUntil = gNow + 1e6;
+    return;
+  }
+  if( data == 0xFC )
+  {
+    gPlaying = false;
+    printf("%9.3f s  stop at clock %ld\n", gNow / 1e6, gSongClock);
+    return;
+  }
+  if( data & 0x80 )
+  {
+    gLastStatus = data;
+    gDataCount = 0;
+    return;
+  }
+  if( gLastStatus == 0xF2 )
+  {
+    gData[gDataCount++] = data;
+    if( gDataCount == 2 )
+      gSongClock = (gData[0] | (gData[1] << 7)) * 6L;
+  }
+}
+
+static void usage(const char * name)
+{
+  fprintf(stderr,
+          "usage: %s [-r fps] [-s speed] [-b bpm] [-j us] [-d at,ms] [-l at,seconds] [-t seconds]\n"
+          "  -r  frame rate: 24, 25, 29.97 (drop frame) or 30 (default 25)\n"
+          "  -s  timecode speed, 1.0 at nominal rate (default 1.0)\n"
+          "  -b  song tempo (default 120)\n"
+          "  -j  max random delay of each quarter frame, us (default 1000)\n"
+          "  -d  no timecode for ms milliseconds from at seconds\n"
+          "  -l  at seconds, jump forward by seconds of timecode\n"
+          "  -t  duration, seconds (default 30)\n"
+          "Song starts at 01:00:00:00, timecode starts 2 s earlier.\n", name);
+}
+
+int main(int argc, char ** argv)
+{
+  float fps = 25.0f;
+  float speed = 1.0f;
+  float jitterUs = 1000.0f;
+  float dropoutAt = -1.0f, dropoutMs = 0.0f;
+  float jumpAt = -1.0f, jumpSeconds = 0.0f;
+  float duration = 30.0f;
+  
+  int opt;
+  while( (opt = getopt(argc, argv, "r:s:b:j:d:l:t:h")) != -1 )
+  {
+    switch( opt )
+    {
+      case 'r': fps = atof(optarg); break;
+      case 's': speed = atof(optarg); break;
+      case 'b': gBpm = atof(optarg); break;
+      case 'j': jitterUs = atof(optarg); break;
+      case 'd': if( sscanf(optarg, "%f,%f", &dropoutAt, &dropoutMs) != 2 ) { usage(argv[0]); return 2; } break;
+      case 'l': if( sscanf(optarg, "%f,%f", &jumpAt, &jumpSeconds) != 2 ) { usage(argv[0]); return 2; } break;
+      case 't': duration = atof(optarg); break;
+      default: usage(argv[0]); return 2;
+    }
+  }
+  
+  byte rate = 1;
+  if( fps < 24.5f ) rate = 0;
+  else if( fps < 27.0f ) rate = 1;
+  else if( fps < 29.985f ) rate = 2;
+  else rate = 3;
+  
+  MtcSource source(rate, speed);
+  gSource = &source;
+  
+  MtcReader reader;
+  MidiProxy midi;
+  MtcChase chase(reader, midi);
+  chase.setStartTime(1, 0, 0, 0);
+  chase.setBpm(gBpm);
+  {
+    // Song start as a frame count at the source rate
+    MtcReader rateReader;
+    rateReader.onFullFrame(1 | (rate << 5), 0, 0, 0, 0);
+    gStartFrame = rateReader.toFrames(1, 0, 0, 0);
+  }
+  
+  Serial.setWriteHook(onOutput);
+  midi.setup();
+  MidiProxy::setModeClock();
+  midi.setBpm(gBpm);
+  // Transport as set up by the firmware (TRANSPORT_QUANTIZE, START_PREROLL_US)
+  midi.setQuantize(MidiProxy::QuantizeBeat);
+  midi.setStartPreroll(1000);
+  
+  // Whole quarter frame sequence, so the first one decoded is on time
+  const long firstFrame = gStartFrame - static_cast<long>(2 * source.frameRate());
+  source.locate(firstFrame - (firstFrame & 1), 0.0);
+  long quarterFrame = 0;
+  double nextDelivery = 0.0;
+  const long baseQuarterFrame = (firstFrame - (firstFrame & 1)) * 4;
+  long jumpBase = baseQuarterFrame;
+  bool jumped = false;
+  MtcReader::State lastState = reader.getState();
+  
+  srand(1);
+  const double endUs = duration * 1e6;
+  for( gNow = 0.0; gNow < endUs; gNow += SIM_LOOP_US )
+  {
+    // Quarter frames due since the last loop, read by MidiMerge at loop time
+    for( ;; )
+    {
+      const double sent = source.quarterFrameTime(quarterFrame);
+      const bool inDropout = dropoutAt >= 0.0f && sent >= dropoutAt * 1e6
+                             && sent < dropoutAt * 1e6 + dropoutMs * 1e3;
+      const double delivered = fmax(sent + jitterUs * (rand() / (RAND_MAX + 1.0)), nextDelivery);
+      if( delivered > gNow )
+        break;
+      if( !inDropout )
+      {
+        reader.onQuarterFrame(source.quarterFrame(jumpBase + quarterFrame), static_cast<unsigned long>(gNow));
+        nextDelivery = delivered;
+      }
+      ++quarterFrame;
+    }
+    
+    if( !jumped && jumpAt >= 0.0f && gNow >= jumpAt * 1e6 )
+    {
+      // Full frame at the new position, quarter frames from the next frame pair
+      jumped = true;
+      long frame = static_cast<long>(source.position(gNow) + jumpSeconds * source.frameRate());
+      frame -= (frame & 1);
+      byte hours, minutes, seconds, frames;
+      source.toTimecode(frame, hours, minutes, seconds, frames);
+      reader.onFullFrame(hours | (rate << 5), minutes, seconds, frames, static_cast<unsigned long>(gNow));
+      printf("%9.3f s  jump to %02d:%02d:%02d:%02d\n", gNow / 1e6, hours, minutes, seconds, frames);
+      source.locate(frame, gNow + 10000.0);
+      jumpBase = frame * 4;
+      quarterFrame = 0;
+      nextDelivery = 0.0;
+    }
+    
+    chase.update(static_cast<unsigned long>(gNow));
+    if( reader.getState() != lastState )
+    {
+      static const char * names[] = { "unlocked", "locking", "locked", "freewheel" };
+      lastState = reader.getState();
+      printf("%9.3f s  %s", gNow / 1e6, names[lastState]);
+      if( lastState == MtcReader::Locked )
+        printf(" after %.1f ms", reader.getLockLatencyUs() / 1000.0f);
+      printf("\n");
+    }
+    advanceTimer(SIM_LOOP_US);
+  }
+  
+  printf("measured %.3f fps, timecode error: last %ld us, max %lu us since lock\n",
+         reader.getFrameRate() * reader.getSpeed(), reader.getLastErrorUs(), reader.getMaxErrorUs());
+  if( gErrorCount > 0 )
+    printf("clock phase error (1 s after each start): mean %.3f ms, max %.3f ms over %ld clocks, %d start(s)\n",
+           gSumError / gErrorCount, gMaxError, gErrorCount, gStarts);
+  else
+    printf("no clock sent while playing\n");
+  return 0;
+}
@@ -0,0 +1,248 @@
+/*                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                      /*
+ MidiClockCtl : MIDI controller (Time Clock) with rotary encoder, 4 digit 7seg display and footswitches.
+ Copyright (C) 2013 Adrien Anselme
+
+ This file is part of MidiClockCtl.
+
+ MidiClockCtl is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 2 of the License, or
+ (at your option) any later version.
+
+ MidiClockCtl is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with MidiClockCtl.  If not, see <http://www.gnu.org/licenses/>.
+*/
+/*
+ Runs the auto tempo detector (OnsetDetector, TempoEstimator) on a recording,
+ sampled like the firmware does: the file is point sampled at ONSET_SAMPLE_RATE
+ and scaled to 10 bit ADC values around mid-scale (line input biased at 2.5V).
+ Prints onsets and tempo changes. With -e, exits non zero if the last tempo
+ found is not the expected one, so detector changes can be checked on a set of
+ recordings. Without a file, a synthesized kick pattern is used (-k).
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include <unistd.h>
+#include <vector>
+#include "Arduino.h"
+#include "../midi_clock_ctl/onset.h"
+
+/////////////////////////////////////
+// 16 bit PCM WAV, mixed to mono
+class WavReader
+{
+public:
+  WavReader() : mFile(0), mChannels(0), mSampleRate(0), mFramesLeft(0) {}
+  ~WavReader() { if( mFile ) fclose(mFile); }
+  
+  bool open(const char * path)
+  {
+    mFile = fopen(path, "rb");
+    if( !mFile )
+    {
+      perror(path);
+      return false;
+    }
+    
+    char riff[12];
+    if( fread(riff, 1, 12, mFile) != 12 || memcmp(riff, "RIFF", 4) != 0 || memcmp(riff + 8, "WAVE", 4) != 0 )
+      return fail(path, "not a WAV file");
+    
+    bool hasFormat = false;
+    for( ;; )
+    {
+      unsigned char header[8];
+      if( fread(header, 1, 8, mFile) != 8 )
+        return fail(path, "no data chunk");
+      const uint32_t size = header[4] | (header[5] << 8) | (header[6] << 16) | ((uint32_t)header[7] << 24);
+      
+      if( memcmp(header, "fmt ", 4) == 0 )
+      {
+        unsigned char fmt[16];
+        if( size < 16 || fread(fmt, 1, 16, mFile) != 16 )
+          return fail(path, "bad fmt chunk");
+        const int format = fmt[0] | (fmt[1] << 8);
+        mChannels = fmt[2] | (fmt[3] << 8);
+        mSampleRate = fmt[4] | (fmt[5] << 8) | (fmt[6] << 16) | ((uint32_t)fmt[7] << 24);
+        const int bits = fmt[14] | (fmt[15] << 8);
+        if( format != 1 || bits != 16 || mChannels < 1 )
+          return fail(path, "only 16 bit PCM is supported");
+        fseek(mFile, size - 16 + (size & 1), SEEK_CUR);
+        hasFormat = true;
+      }
+      else if( memcmp(header, "data", 4) == 0 )
+      {
+        if( !hasFormat )
+          return fail(path, "data before fmt chunk");
+        mFramesLeft = size / (2 * mChannels);
+        return true;
+      }
+      else
+        fseek(mFile, size + (size & 1), SEEK_CUR);
+    }
+  }
+  
+  /// Next frame as a mono sample in [-32768, 32767], false at end of data
+  bool read(int & sample)
+  {
+    if( mFramesLeft == 0 )
+      return false;
+    --mFramesLeft;
+    
+    long sum = 0;
+    for( int c = 0; c < mChannels; ++c )
+    {
+      unsigned char bytes[2];
+      if( fread(bytes, 1, 2, mFile) != 2 )
+        return false;
+      sum += (int16_t)(bytes[0] | (bytes[1] << 8));
+    }
+    sample = sum / mChannels;
+    return true;
+  }
+  
+  unsigned long sampleRate() const { return mSampleRate; }
+  
+private:
+  bool fail(const char * path, const char * msg)
+  {
+    fprintf(stderr, "%s: %s\n", path, msg);
+    return false;
+  }
+  
+private:
+  FILE * mFile;
+  int mChannels;
+  unsigned long mSampleRate;
+  unsigned long mFramesLeft;
+};
+
+/////////////////////////////////////
+// Kick drum: decaying pitch-dropping sine, over some noise
+class KickSynth
+{
+public:
+  KickSynth(const double bpm, const double seconds, const double sampleRate)
+  : mPeriod(sampleRate * 60.0 / bpm), mSampleRate(sampleRate),
+    mFrames((unsigned long)(seconds * sampleRate)), mFrame(0)
+  {
+    srand(1);
+  }
+  
+  bool read(int & sample)
+  {
+    if( mFrame >= mFrames )
+      return false;
+    
+    const double t = fmod((double)mFrame, mPeriod) / mSampleRate;
+    const double kick = exp(-t * 12.0) * sin(2.0 * M_PI * (50.0 * t + 4.0 * (1.0 - exp(-t * 20.0))));
+    const double noise = (rand() / (double)RAND_MAX - 0.5) * 0.05;
+    sample = (int)((kick * 0.8 + noise) * 32767.0);
+    ++mFrame;
+    return true;
+  }
+  
+private:
+  const double mPeriod;
+  const double mSampleRate;
+  const unsigned long mFrames;
+  unsigned long mFrame;
+};
+
+/////////////////////////////////////
+static void usage(const char * name)
+{
+  fprintf(stderr,
+          "usage: %s [-k bpm] [-m min_bpm] [-e expected_bpm] [-t tolerance_bpm] [-q] [file.wav]\n"
+          "  -k  synthesized kick pattern at this tempo when no file is given (default 120)\n"
+          "  -m  lowest tempo reported (default 80)\n"
+          "  -e  expected tempo: exit code is 2 if the last tempo found is off\n"
+          "  -t  tolerance on the expected tempo (default 1)\n"
+          "  -q  don't print onsets\n",
+          name);
+}
+
+int main(int argc, char ** argv)
+{
+  double kickBpm = 120.0;
+  double minBpm = 80.0;
+  double expectedBpm = 0.0;
+  double tolerance = 1.0;
+  bool quiet = false;
+  
+  int opt;
+  while( (opt = getopt(argc, argv, "k:m:e:t:qh")) != -1 )
+  {
+    switch( opt )
+    {
+      case 'k': kickBpm = atof(optarg); break;
+      case 'm': minBpm = atof(optarg); break;
+      case 'e': expectedBpm = atof(optarg); break;
+      case 't': tolerance = atof(optarg); break;
+      case 'q': quiet = true; break;
+      default:
+        usage(argv[0]);
+        return 1;
+    }
+  }
+  
+  WavReader wav;
+  const bool useFile = (optind < argc);
+  if( useFile && !wav.open(argv[optind]) )
+    return 1;
+  const double inputRate = useFile ? wav.sampleRate() : 44100.0;
+  KickSynth synth(kickBpm, 20.0, inputRate);
+  
+  OnsetDetector detector;
+  TempoEstimator estimator(ONSET_SAMPLE_RATE);
+  estimator.setMinBpm(minBpm);
+  
+  // Point sampling: the ADC samples and holds, no anti-alias filter in front
+  const double step = inputRate / ONSET_SAMPLE_RATE;
+  double nextFrame = 0.0;
+  unsigned long frame = 0;
+  unsigned long adcIndex = 0;
+  unsigned long onsets = 0;
+  float lastBpm = 0.0f;
+  
+  int sample;
+  while( useFile ? wav.read(sample) : synth.read(sample) )
+  {
+    if( frame++ < nextFrame )
+      continue;
+    nextFrame += step;
+    
+    const int adc = constrain(512 + sample / 64, 0, 1023);
+    if( detector.process(adc) )
+    {
+      ++onsets;
+      const float bpm = estimator.onset(adcIndex);
+      if( !quiet )
+        printf("onset %7.3f s%s", adcIndex / ONSET_SAMPLE_RATE, (bpm > 0.0f) ? "" : "\n");
+      if( bpm > 0.0f )
+      {
+        if( !quiet )
+          printf("  tempo %.1f BPM\n", bpm);
+        lastBpm = bpm;
+      }
+    }
+    ++adcIndex;
+  }
+  
+  printf("%lu onsets in %.1f s, tempo %.1f BPM\n", onsets, adcIndex / ONSET_SAMPLE_RATE, lastBpm);
+  
+  if( expectedBpm > 0.0 && fabs(lastBpm - expectedBpm) > tolerance )
+  {
+    fprintf(stderr, "expected %.1f BPM\n", expectedBpm);
+    return 2;
+  }
+  return 0;
+}
@@ -0,0 +1,150 @@
+/*                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                      /*
+ MidiClockCtl : MIDI controller (Time Clock) with rotary encoder, 4 digit 7seg display and footswitches.
+ Copyright (C) 2013 Adrien Anselme
+
+ This file is part of MidiClockCtl.
+
+ MidiClockCtl is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 2 of the License, or
+ (at your option) any later version.
+
+ MidiClockCtl is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with MidiClockCtl.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include "calibration.h"
+
+// Quarter frame carrying the hours high nibble and the SMPTE rate
+#define MTC_QF_HOURS_HIGH 0x70
+
+ClockCalibration::ClockCalibration()
+: mRunning(false), mReference(ReferenceNone), mPpsPin(-1), mPpsLevel(false),
+  mReferenceBpm(120.0f), mMtcRate(0), mTickCount(0), mFirstTime(0), mLastTime(0)
+{
+}
+
+ClockCalibration::~ClockCalibration()
+{
+}
+
+void ClockCalibration::setPpsPin(const int pin)
+{
+  mPpsPin = pin;
+  if( mPpsPin >= 0 )
+    pinMode(mPpsPin, INPUT);
+}
+
+void ClockCalibration::setReferenceBpm(const float bpm)
+{
+  mReferenceBpm = bpm;
+}
+
+void ClockCalibration::start()
+{
+  mRunning = true;
+  mReference = ReferenceNone;
+  mTickCount = 0;
+  if( mPpsPin >= 0 )
+    mPpsLevel = (digitalRead(mPpsPin) == HIGH);
+}
+
+void ClockCalibration::stop()
+{
+  mRunning = false;
+}
+
+bool ClockCalibration::isRunning() const
+{
+  return mRunning;
+}
+
+void ClockCalibration::onMidiClock()
+{
+  referenceTick(ReferenceMidiClock);
+}
+
+void ClockCalibration::onQuarterFrame(const byte data)
+{
+  if( (data & 0x70) == MTC_QF_HOURS_HIGH )
+    mMtcRate = (data >> 1) & 0x03;
+  referenceTick(ReferenceMTC);
+}
+
+void ClockCalibration::update()
+{
+  if( !mRunning || mPpsPin < 0 )
+    return;
+    
+  const bool level = (digitalRead(mPpsPin) == HIGH);
+  if( level && !mPpsLevel )
+    referenceTick(ReferencePps);
+  mPpsLevel = level;
+}
+
+void ClockCalibration::referenceTick(const Reference reference)
+{
+  if( !mRunning )
+    return;
+  
+  const unsigned long currentTime = micros();
+  if( mReference == ReferenceNone )
+  {
+    mReference = reference;
+    mFirstTime = currentTime;
+    mLastTime = currentTime;
+    return;
+  }
+  
+  if( reference != mReference || currentTime - mFirstTime > CALIBRATION_MAX_SECONDS * 1000000UL )
+    return;
+    
+  ++mTickCount;
+  mLastTime = currentTime;
+}
+
+const float ClockCalibration::nominalPeriodUs() const
+{
+  switch( mReference )
+  {
+    case ReferenceMidiClock:
+      return 60000000.0f / (mReferenceBpm * 24);
+    case ReferenceMTC:
+    {
+      // 4 quarter frames per frame
+      static const float frameRates[4] = { 24.0f, 25.0f, 30000.0f / 1001.0f, 30.0f };
+      return 1000000.0f / (frameRates[mMtcRate] * 4);
+    }
+    case ReferencePps:
+      return 1000000.0f;
+    default:
+      return 0.0f;
+  }
+}
+
+bool ClockCalibration::hasEnoughTime() const
+{
+  return mTickCount * nominalPeriodUs() >= CALIBRATION_MIN_SECONDS * 1000000.0f;
+}
+
+bool ClockCalibration::hasResult() const
+{
+  return hasEnoughTime() && labs(errorPpm()) <= CALIBRATION_MAX_PPM;
+}
+
+const long ClockCalibration::measuredPpm() const
+{
+  return hasResult() ? errorPpm() : 0;
+}
+
+const long ClockCalibration::errorPpm() const
+{
+  // micros() counts CPU cycles: it runs fast when the CPU clock does
+  const float nominalUs = mTickCount * nominalPeriodUs();
+  const float measuredUs = mLastTime - mFirstTime;
+  return lround((measuredUs - nominalUs) / nominalUs * 1000000.0f);
+}
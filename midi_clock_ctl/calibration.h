@@ -0,0 +1,92 @@
+/*                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                      /*
+ MidiClockCtl : MIDI controller (Time Clock) with rotary encoder, 4 digit 7seg display and footswitches.
+ Copyright (C) 2013 Adrien Anselme
+
+ This file is part of MidiClockCtl.
+
+ MidiClockCtl is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 2 of the License, or
+ (at your option) any later version.
+
+ MidiClockCtl is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with MidiClockCtl.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef _MIDI_CLOCK_CTL_CALIBRATION_H_
+#define _MIDI_CLOCK_CTL_CALIBRATION_H_
+
+#include <Arduino.h>
+
+// Reference time needed before a result is given
+#define CALIBRATION_MIN_SECONDS 60
+// micros() wraps after 71 minutes: measurement stops before
+#define CALIBRATION_MAX_SECONDS 3600
+// Largest error of a ceramic resonator: more is a wrong reference (e.g. a MIDI
+// clock master not at the tempo set)
+#define CALIBRATION_MAX_PPM 5000
+
+/////////////////////////////////////
+// Measures the CPU clock error against a reference: incoming MIDI clock
+// at a known tempo, incoming MTC, or a 1 PPS signal on an input pin.
+// Reference events are time stamped with micros() from the main loop:
+// loop latency only affects the first and last events, so it is divided
+// by the length of the measurement (1 ms over 5 minutes is 3 ppm).
+class ClockCalibration
+{
+public:
+  enum Reference
+  {
+    ReferenceNone = 0,
+    ReferenceMidiClock,
+    ReferenceMTC,
+    ReferencePps
+  };
+  
+  ClockCalibration();
+  ~ClockCalibration();
+  
+  /// 1 PPS input polled by update(), -1 for none
+  void setPpsPin(const int pin);
+  /// Tempo of the incoming MIDI clock, used when it is the reference
+  void setReferenceBpm(const float bpm);
+  
+  /// The first reference seen after start() is used until stop()
+  void start();
+  void stop();
+  bool isRunning() const;
+  
+  void onMidiClock();
+  void onQuarterFrame(const byte data);
+  
+  // To be called in main loop function
+  void update();
+  
+  /// True once enough reference time was measured, with a plausible error
+  bool hasResult() const;
+  /// CPU clock error, positive when running fast. 0 without a result
+  const long measuredPpm() const;
+  
+private:
+  void referenceTick(const Reference reference);
+  bool hasEnoughTime() const;
+  const long errorPpm() const;
+  const float nominalPeriodUs() const;
+  
+private:
+  bool mRunning;
+  Reference mReference;
+  int mPpsPin;
+  bool mPpsLevel;
+  float mReferenceBpm;
+  byte mMtcRate;              // SMPTE rate bits from the last hours high quarter frame
+  unsigned long mTickCount;   // Reference periods since the first event
+  unsigned long mFirstTime;
+  unsigned long mLastTime;
+};
+
+#endif
@@ -0,0 +1,118 @@
+/*                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                      /*
+ MidiClockCtl : MIDI controller (Time Clock) with rotary encoder, 4 digit 7seg display and footswitches.
+ Copyright (C) 2013 Adrien Anselme
+
+ This file is part of MidiClockCtl.
+
+ MidiClockCtl is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 2 of the License, or
+ (at your option) any later version.
+
+ MidiClockCtl is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with MidiClockCtl.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include "click.h"
+
+// Phase correct PWM is 16 MHz / 510, one sample per period
+#define CLICK_SAMPLE_RATE 31373UL
+// Output between clicks, middle of the PWM range
+#define CLICK_IDLE_LEVEL 128
+// Slaves act on a clock once its byte is received (10 bits at 31250 baud):
+// the click waits as long, so it sounds with them
+#define CLICK_DELAY_SAMPLES 10
+// Lengths, 20 and 30 ms
+#define CLICK_LENGTH_SAMPLES 627
+#define CLICK_DOWNBEAT_LENGTH_SAMPLES 941
+#define CLICK_TONE_HZ 1500UL
+#define CLICK_DOWNBEAT_TONE_HZ 2500UL
+#define CLICK_AMPLITUDE 80
+#define CLICK_DOWNBEAT_AMPLITUDE 127
+// Amplitude loses 1/8 every this many samples (about 1 ms)
+#define CLICK_DECAY_SAMPLES 32
+
+void Click::setup(const Sound sound)
+{
+  mSound = sound;
+  pinMode(CLICK_PIN, OUTPUT);
+  
+  noInterrupts();
+  // Phase correct PWM, non inverting on OC2A, no prescaler
+  TCCR2A = (1 << COM2A1) | (1 << WGM20);
+  TCCR2B = (1 << CS20);
+  OCR2A = CLICK_IDLE_LEVEL;
+  // Overflow interrupt only enabled while a click plays
+  TIMSK2 = 0;
+  interrupts();
+}
+
+void Click::trigger(const bool downbeat)
+{
+  mAmplitude = downbeat ? CLICK_DOWNBEAT_AMPLITUDE : CLICK_AMPLITUDE;
+  mPhaseStep = (downbeat ? CLICK_DOWNBEAT_TONE_HZ : CLICK_TONE_HZ) * 65536UL / CLICK_SAMPLE_RATE;
+  mSamplesLeft = downbeat ? CLICK_DOWNBEAT_LENGTH_SAMPLES : CLICK_LENGTH_SAMPLES;
+  mPhase = 0;
+  mDelay = CLICK_DELAY_SAMPLES;
+  mDecayCount = CLICK_DECAY_SAMPLES;
+  
+  // Restarts a click still playing
+  TIFR2 = (1 << TOV2);
+  TIMSK2 |= (1 << TOIE2);
+}
+
+void Click::doSample()
+{
+  if( mDelay > 0 )
+  {
+    --mDelay;
+    return;
+  }
+  
+  if( mSamplesLeft == 0 )
+  {
+    OCR2A = CLICK_IDLE_LEVEL;
+    TIMSK2 &= ~(1 << TOIE2);
+    return;
+  }
+  --mSamplesLeft;
+  
+  bool high;
+  if( mSound == Noise )
+  {
+    // 16 bit Galois LFSR
+    const bool bit = mNoise & 0x01;
+    mNoise = (mNoise >> 1) ^ (bit ? 0xB400 : 0);
+    high = bit;
+  }
+  else
+  {
+    mPhase += mPhaseStep;
+    high = mPhase & 0x8000;
+  }
+  OCR2A = high ? CLICK_IDLE_LEVEL + mAmplitude : CLICK_IDLE_LEVEL - mAmplitude;
+  
+  if( --mDecayCount == 0 )
+  {
+    mDecayCount = CLICK_DECAY_SAMPLES;
+    mAmplitude -= mAmplitude >> 3;
+  }
+}
+
+ISR(TIMER2_OVF_vect)
+{
+  Click::doSample();
+}
+
+Click::Sound Click::mSound = Click::Tone;
+volatile byte Click::mDelay = 0;
+volatile unsigned int Click::mSamplesLeft = 0;
+volatile byte Click::mAmplitude = 0;
+volatile byte Click::mDecayCount = CLICK_DECAY_SAMPLES;
+volatile unsigned int Click::mPhase = 0;
+volatile unsigned int Click::mPhaseStep = 0;
+volatile unsigned int Click::mNoise = 0xACE1;
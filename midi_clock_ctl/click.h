@@ -0,0 +1,64 @@
+/*                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                      /*
+ MidiClockCtl : MIDI controller (Time Clock) with rotary encoder, 4 digit 7seg display and footswitches.
+ Copyright (C) 2013 Adrien Anselme
+
+ This file is part of MidiClockCtl.
+
+ MidiClockCtl is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 2 of the License, or
+ (at your option) any later version.
+
+ MidiClockCtl is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with MidiClockCtl.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef _MIDI_CLOCK_CTL_CLICK_H_
+#define _MIDI_CLOCK_CTL_CLICK_H_
+
+#include <Arduino.h>
+
+// Timer2 PWM output A: fixed pin (needs an RC low-pass and a coupling
+// capacitor before a headphone amplifier)
+#define CLICK_PIN 11
+
+/////////////////////////////////////
+// Metronome click triggered by the clock interrupt on each beat (see
+// MidiProxy::setBeatHandler): a short decaying tone or noise burst, higher
+// and louder on the downbeat. Timer2 runs an 8 bit phase correct PWM at
+// 31.4 kHz, the sample rate: its overflow interrupt computes one sample per
+// period, and is only enabled while a click plays (about 15% of the CPU then).
+class Click
+{
+public:
+  enum Sound
+  {
+    Tone = 0,
+    Noise
+  };
+  
+  static void setup(const Sound sound);
+  
+  /// From the clock interrupt, right after the clock byte is written
+  static void trigger(const bool downbeat);
+  
+  /// Timer2 overflow interrupt
+  static void doSample();
+  
+private:
+  // Note:  all variables changed within interrupts are volatile
+  static Sound mSound;
+  static volatile byte mDelay;
+  static volatile unsigned int mSamplesLeft;
+  static volatile byte mAmplitude;
+  static volatile byte mDecayCount;
+  static volatile unsigned int mPhase;
+  static volatile unsigned int mPhaseStep;
+  static volatile unsigned int mNoise;
+};
+
+#endif
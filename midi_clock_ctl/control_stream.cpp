@@ -0,0 +1,145 @@
+/*                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                      /*
+ MidiClockCtl : MIDI controller (Time Clock) with rotary encoder, 4 digit 7seg display and footswitches.
+ Copyright (C) 2013 Adrien Anselme
+
+ This file is part of MidiClockCtl.
+
+ MidiClockCtl is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 2 of the License, or
+ (at your option) any later version.
+
+ MidiClockCtl is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with MidiClockCtl.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include "control_stream.h"
+#include "midi_proxy.h"
+
+#define CONTROL_STREAM_PERIOD_US (1000000UL / CONTROL_STREAM_RATE_HZ)
+// 31250 baud, 10 bits per byte
+#define MIDI_BYTES_PER_SECOND 3125UL
+
+#define CC_DATA_ENTRY_MSB 6
+#define CC_DATA_ENTRY_LSB 38
+#define CC_NRPN_LSB 98
+#define CC_NRPN_MSB 99
+#define CC_RPN_LSB 100
+#define CC_RPN_MSB 101
+
+ControlStream::ControlStream()
+: mFormat(Cc14), mChannel(1), mParameter(0), mTarget(0), mValue(0), mHasTarget(false),
+  mHasSent(false), mSelectNrpn(false), mByteCostUs(0), mLastUpdate(0), mNextAllowed(0)
+{
+}
+
+ControlStream::~ControlStream()
+{
+}
+
+void ControlStream::setup(const Format format, const byte channel, const unsigned int parameter,
+                          const byte bandwidthPercent)
+{
+  mFormat = format;
+  mChannel = channel;
+  mParameter = (format == Cc14) ? (parameter & 0x1F) : (parameter & 0x3FFF);
+  const unsigned long bytesPerSecond = max(MIDI_BYTES_PER_SECOND * constrain(bandwidthPercent, 1, 100) / 100, 1UL);
+  mByteCostUs = 1000000UL / bytesPerSecond;
+  mHasTarget = false;
+  mHasSent = false;
+  mSelectNrpn = (format == Nrpn);
+}
+
+void ControlStream::setTarget(const unsigned int value)
+{
+  mTarget = min(value, 0x3FFFU);
+  mHasTarget = true;
+}
+
+unsigned int ControlStream::getTarget() const
+{
+  return mTarget;
+}
+
+unsigned int ControlStream::getValue() const
+{
+  return mValue;
+}
+
+void ControlStream::onThruController(const byte status, const byte controller)
+{
+  if( mFormat != Nrpn || status != (0xB0 | ((mChannel - 1) & 0x0F)) )
+    return;
+  if( controller == CC_NRPN_LSB || controller == CC_NRPN_MSB
+      || controller == CC_RPN_LSB || controller == CC_RPN_MSB )
+    mSelectNrpn = true;
+}
+
+void ControlStream::update(const unsigned long now)
+{
+  if( !mHasTarget || (mHasSent && mValue == mTarget) )
+    return;
+  if( now - mLastUpdate < CONTROL_STREAM_PERIOD_US )
+    return;
+  // Bandwidth used by the previous update not paid back yet
+  if( static_cast<long>(now - mNextAllowed) < 0 )
+    return;
+  
+  // Next step toward the target, at least one
+  unsigned int value = mTarget;
+  if( mHasSent )
+  {
+    const int distance = static_cast<int>(mTarget) - static_cast<int>(mValue);
+    int step = distance / (1 << CONTROL_STREAM_SMOOTHING_SHIFT);
+    if( step == 0 )
+      step = (distance > 0) ? 1 : -1;
+    value = mValue + step;
+  }
+  
+  byte message[9];
+  const byte length = buildMessage(value, message);
+  if( Serial.availableForWrite() < length + CONTROL_STREAM_TX_HEADROOM )
+    return;
+  
+  MidiProxy::writeMessage(message, length);
+  mValue = value;
+  mHasSent = true;
+  mSelectNrpn = false;
+  mLastUpdate = now;
+  mNextAllowed = now + length * mByteCostUs;
+}
+
+// Controller messages for value, with running status (a single write:
+// nothing else can come in between, real time bytes don't cancel it)
+byte ControlStream::buildMessage(const unsigned int value, byte * message) const
+{
+  const byte msb = value >> 7;
+  const byte lsb = value & 0x7F;
+  const bool msbChanged = !mHasSent || msb != (mValue >> 7);
+  
+  byte length = 0;
+  message[length++] = 0xB0 | ((mChannel - 1) & 0x0F);
+  
+  const byte msbController = (mFormat == Cc14) ? mParameter : CC_DATA_ENTRY_MSB;
+  const byte lsbController = (mFormat == Cc14) ? mParameter + 32 : CC_DATA_ENTRY_LSB;
+  if( mSelectNrpn )
+  {
+    message[length++] = CC_NRPN_MSB;
+    message[length++] = mParameter >> 7;
+    message[length++] = CC_NRPN_LSB;
+    message[length++] = mParameter & 0x7F;
+  }
+  if( msbChanged )
+  {
+    message[length++] = msbController;
+    message[length++] = msb;
+  }
+  // After a new MSB, or alone
+  message[length++] = lsbController;
+  message[length++] = lsb;
+  return length;
+}
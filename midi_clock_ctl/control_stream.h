@@ -0,0 +1,87 @@
+/*                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                      /*
+ MidiClockCtl : MIDI controller (Time Clock) with rotary encoder, 4 digit 7seg display and footswitches.
+ Copyright (C) 2013 Adrien Anselme
+
+ This file is part of MidiClockCtl.
+
+ MidiClockCtl is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 2 of the License, or
+ (at your option) any later version.
+
+ MidiClockCtl is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with MidiClockCtl.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef _MIDI_CLOCK_CTL_CONTROL_STREAM_H_
+#define _MIDI_CLOCK_CTL_CONTROL_STREAM_H_
+
+#include <Arduino.h>
+
+// Output updates per second while the value moves
+#define CONTROL_STREAM_RATE_HZ 100
+// Each update moves the output 1/2^shift of the way to the target
+#define CONTROL_STREAM_SMOOTHING_SHIFT 2
+// Bytes kept free in the serial transmit buffer, so a clock written
+// by the timer interrupt never waits for room
+#define CONTROL_STREAM_TX_HEADROOM 16
+
+/////////////////////////////////////
+// Streams a 14 bit controller value, as a CC pair (MSB on cc, LSB on cc + 32)
+// or as NRPN data entry. The output follows the target (e.g. the encoder)
+// at a fixed rate with smoothing, so steps of the encoder become sweeps.
+// Only changed bytes are sent: the LSB alone when the MSB didn't change,
+// the MSB followed by the LSB otherwise (receivers may reset the LSB on a
+// new MSB). Output is limited to a share of the MIDI bandwidth. Nothing is
+// sent before the first setTarget(), so the receiver keeps its value at boot.
+class ControlStream
+{
+public:
+  enum Format
+  {
+    Cc14 = 0,   ///< Parameter is the MSB controller, 0 to 31
+    Nrpn        ///< Parameter is the NRPN number, 0 to 16383
+  };
+  
+  ControlStream();
+  ~ControlStream();
+  
+  /// Channel 1 to 16. Bandwidth share in percent of 3125 bytes/s
+  void setup(const Format format, const byte channel, const unsigned int parameter,
+             const byte bandwidthPercent);
+  
+  /// 0 to 16383
+  void setTarget(const unsigned int value);
+  unsigned int getTarget() const;
+  /// Value last sent
+  unsigned int getValue() const;
+  
+  /// Controller merged from MIDI in: a parameter selection (NRPN or RPN) on
+  /// the stream's channel makes the NRPN number go out again
+  void onThruController(const byte status, const byte controller);
+  
+  /// To be called in main loop function
+  void update(const unsigned long now);
+  
+private:
+  byte buildMessage(const unsigned int value, byte * message) const;
+  
+private:
+  Format mFormat;
+  byte mChannel;
+  unsigned int mParameter;
+  unsigned int mTarget;
+  unsigned int mValue;
+  bool mHasTarget;        // setTarget() called: the stream may start
+  bool mHasSent;          // Nothing sent yet: all bytes go out
+  bool mSelectNrpn;       // NRPN number to be sent before the next value
+  unsigned long mByteCostUs;
+  unsigned long mLastUpdate;
+  unsigned long mNextAllowed;
+};
+
+#endif
@@ -19,12 +19,24 @@
 */
 #include "controls.h"
 #include "Arduino.h"
+#include "trace.h"
 
 #define SELECTOR_LOW_LIMIT 340
 #define SELECTOR_HIGH_LIMIT 680
+// Limits are moved away from the current position by this much,
+// so a noisy pot sitting on a threshold can't bounce modes
+#define SELECTOR_HYSTERESIS 40
+// Averaging over 2^SELECTOR_FILTER_SHIFT samples
+#define SELECTOR_FILTER_SHIFT 3
+// A new position must be seen on this many consecutive samples
+// (about 1 ms each, 2 ms with an aux input, see setupSelectorSampling) before being reported
+#define SELECTOR_SETTLE_SAMPLES 20
 
-#define SHORT_PRESS 350
-#define LONG_PRESS 1500
+// In readBtn() calls while held: milliseconds when scanned every 1 ms
+#define SHORT_PRESS 100
+#define LONG_PRESS 500
+// Released for more than this many readBtn() calls (4 ms) ends a press: contact bounce
+#define RELEASE_SCANS 4
 
 Controls::Controls(const int btn1Pin, const int btn2Pin, const int btn3Pin,
                    const int btn4Pin, const int btn5Pin, const int btn6Pin,
@@ -34,11 +46,15 @@ Controls::Controls(const int btn1Pin, const int btn2Pin, const int btn3Pin,
   mBtnPin[0] = btn1Pin;
   mBtnPin[1] = btn2Pin;
   mBtnPin[2] = btn3Pin;
+  mBtnPin[3] = btn4Pin;
+  mBtnPin[4] = btn5Pin;
+  mBtnPin[5] = btn6Pin;
+  mBtnPin[6] = btn7Pin;
   
   for( int i = 0; i < CONTROLS_BTN_COUNT; ++i )
   {
     mCounter[i] = 0;
-    mLastKeyPressTime[i] = 0;
+    mReleasedScans[i] = 0;
   }
 }
 
@@ -52,6 +68,44 @@ void Controls::setup()
     pinMode(mBtnPin[i], INPUT);
     digitalWrite(mBtnPin[i], HIGH);  // turn on internal pull-up
   }
+  
+  setupSelectorSampling();
+}
+
+void Controls::setupSelectorSampling()
+{
+  // One blocking conversion to start from a known position
+  // (also lets the core set the ADC reference and prescaler)
+  const int firstValue = analogRead(mSelectorPin);
+  
+  noInterrupts();
+  mSelectorChannel = pinToChannel(mSelectorPin);
+  mSamplingAux = false;
+  mSelectorFiltered = firstValue << SELECTOR_FILTER_SHIFT;
+  mSelectorMode = classifySelector(firstValue, SelectorNone, 0);
+  mSelectorCandidate = mSelectorMode;
+  mSelectorSettleCount = 0;
+  
+  // AVcc reference (same as analogRead), selector channel
+  ADMUX = (1 << REFS0) | mSelectorChannel;
+  // Conversions auto-triggered by Timer0 overflow (~976 Hz, timer already used by millis()),
+  // alternating between selector and aux input if any
+  ADCSRB = (1 << ADTS2);
+  // Enable ADC, auto trigger and conversion complete interrupt, clear pending flag, prescaler 128
+  ADCSRA = (1 << ADEN) | (1 << ADATE) | (1 << ADIE) | (1 << ADIF)
+         | (1 << ADPS2) | (1 << ADPS1) | (1 << ADPS0);
+  interrupts();
+}
+
+void Controls::setAuxInput(const int pin, void (*sampleHandler)(const int sample))
+{
+  mAuxChannel = pinToChannel(pin);
+  mAuxHandler = sampleHandler;
+}
+
+const byte Controls::pinToChannel(const int pin)
+{
+  return ((pin >= A0) ? pin - A0 : pin) & 0x07;
 }
 
 const Controls::ButtonMode Controls::readBtn(const int btnNumber)
@@ -59,19 +113,74 @@ const Controls::ButtonMode Controls::readBtn(const int btnNumber)
   return readPinFiltered(btnNumber - 1);
 }
 
+bool Controls::isHeld(const int btnNumber) const
+{
+  return digitalRead( mBtnPin[btnNumber - 1] ) == LOW;
+}
+
 const Controls::SelectorMode Controls::readSelector()
 {
-  const int pinValue = analogRead(mSelectorPin);
-  
-  if( pinValue < SELECTOR_LOW_LIMIT )
+  return static_cast<SelectorMode>(mSelectorMode);
+}
+
+const Controls::SelectorMode Controls::classifySelector(const int value, const SelectorMode currentMode,
+                                                        const int hysteresis)
+{
+  // Make it harder to leave the current position
+  const int lowLimit = (currentMode == SelectorNone) ? SELECTOR_LOW_LIMIT + hysteresis
+                                                     : SELECTOR_LOW_LIMIT - hysteresis;
+  const int highLimit = (currentMode == SelectorSecond) ? SELECTOR_HIGH_LIMIT - hysteresis
+                                                        : SELECTOR_HIGH_LIMIT + hysteresis;
+  if( value < lowLimit )
     return SelectorNone;
     
-  if( pinValue > SELECTOR_HIGH_LIMIT )
+  if( value > highLimit )
     return SelectorSecond;
     
   return SelectorFirst;
 }
 
+// Called from the ADC conversion complete interrupt
+void Controls::doSampleAdc()
+{
+  const int sample = ADC;
+  
+  if( mAuxHandler == 0 )
+  {
+    processSelectorSample(sample);
+    return;
+  }
+  
+  // Conversion is over: switch input for the next one (triggered ~1 ms later)
+  const bool wasAux = mSamplingAux;
+  mSamplingAux = !wasAux;
+  ADMUX = (1 << REFS0) | (mSamplingAux ? mAuxChannel : mSelectorChannel);
+  
+  if( wasAux )
+    mAuxHandler(sample);
+  else
+    processSelectorSample(sample);
+}
+
+void Controls::processSelectorSample(const int sample)
+{
+  mSelectorFiltered = mSelectorFiltered - (mSelectorFiltered >> SELECTOR_FILTER_SHIFT) + sample;
+  
+  const SelectorMode newMode = classifySelector(mSelectorFiltered >> SELECTOR_FILTER_SHIFT,
+                                                static_cast<SelectorMode>(mSelectorMode),
+                                                SELECTOR_HYSTERESIS);
+  if( newMode != mSelectorCandidate )
+  {
+    mSelectorCandidate = newMode;
+    mSelectorSettleCount = 0;
+  }
+  else if( newMode != mSelectorMode && ++mSelectorSettleCount >= SELECTOR_SETTLE_SAMPLES )
+  {
+    mSelectorMode = newMode;
+    Trace::recordIsr(Trace::SelectorChange, newMode);
+  }
+}
+
 const Controls::ButtonMode Controls::readPinFiltered(const int btnIndex)
 {
   const int duration = readPinDuration(btnIndex);
@@ -81,12 +190,14 @@ const Controls::ButtonMode Controls::readPinFiltered(const int btnIndex)
   {
     // Give us some time before another press is possible:
     mCounter[btnIndex] = - SHORT_PRESS;
+    Trace::recordMain(Trace::ButtonPress, (btnIndex + 1) | 0x80);
     return ButtonLong;
   }
   else if( isOff && duration > SHORT_PRESS )
   {
     // Button is released and it was not a long press => short press
     mCounter[btnIndex] = 0;
+    Trace::recordMain(Trace::ButtonPress, btnIndex + 1);
     return ButtonShort;
   }
     
@@ -95,15 +206,29 @@ const Controls::ButtonMode Controls::readPinFiltered(const int btnIndex)
 
 const int Controls::readPinDuration(const int btnIndex)
 {
-  const unsigned long currentTime = millis();
   if( digitalRead( mBtnPin[btnIndex] ) == LOW )
   {
     ++mCounter[btnIndex];
-    mLastKeyPressTime[btnIndex] = currentTime;
+    mReleasedScans[btnIndex] = 0;
   }
-  else if( (currentTime - mLastKeyPressTime[btnIndex]) > 4 )
+  else if( mReleasedScans[btnIndex] < RELEASE_SCANS )
+    ++mReleasedScans[btnIndex];
+  else
     mCounter[btnIndex] = 0;
 
   return mCounter[btnIndex];
 }
 
+ISR(ADC_vect)
+{
+  Controls::doSampleAdc();
+}
+
+volatile unsigned int Controls::mSelectorFiltered = 0;
+volatile byte Controls::mSelectorCandidate = Controls::SelectorNone;
+volatile byte Controls::mSelectorSettleCount = 0;
+volatile byte Controls::mSelectorMode = Controls::SelectorNone;
+byte Controls::mSelectorChannel = 0;
+byte Controls::mAuxChannel = 0;
+void (*Controls::mAuxHandler)(const int sample) = 0;
+volatile bool Controls::mSamplingAux = false;
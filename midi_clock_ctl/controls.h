@@ -20,6 +20,8 @@
 #ifndef _MIDI_CLOCK_CTL_CONTROLS_H_
 #define _MIDI_CLOCK_CTL_CONTROLS_H_
 
+#include <Arduino.h>
+
 #define CONTROLS_BTN_COUNT 7
 
 /////////////////// Buttons stuff
@@ -47,19 +49,48 @@ class Controls
   
   void setup();
   
-  /* Read button btnNumber (starting from 1) */
+  /// Spare analog input sampled in background along with the selector,
+  /// each sample handed to sampleHandler from the ADC interrupt.
+  /// To be called before setup()
+  void setAuxInput(const int pin, void (*sampleHandler)(const int sample));
+  
+  /* Read button btnNumber (starting from 1). Press durations are counted
+     in calls: to be called at a fixed rate (every 1 ms) */
   const ButtonMode readBtn(const int btnNumber);
+  /// Raw state, for button chords: true while btnNumber is pushed down
+  bool isHeld(const int btnNumber) const;
+  
+  /// Last settled selector position, as filtered by the ADC interrupt.
+  /// Never blocks: the conversions run in background (see doSampleAdc)
   const SelectorMode readSelector();
+  
+  static void doSampleAdc();
 
  private:
   const ButtonMode readPinFiltered(const int btnIndex);
   const int readPinDuration(const int btnIndex);
+  void setupSelectorSampling();
+  static void processSelectorSample(const int sample);
+  static const byte pinToChannel(const int pin);
+  static const SelectorMode classifySelector(const int value, const SelectorMode currentMode,
+                                             const int hysteresis);
   
  private:
-  int mBtnPin[CONTROLS_BTN_COUNT];
-  const int mSelectorPin;
+  byte mBtnPin[CONTROLS_BTN_COUNT];
+  const byte mSelectorPin;
   int mCounter[CONTROLS_BTN_COUNT];
-  unsigned long mLastKeyPressTime[CONTROLS_BTN_COUNT];
+  byte mReleasedScans[CONTROLS_BTN_COUNT];    // readBtn() calls since the button was last seen down
+  
+  // Note:  all variables changed within interrupts are volatile
+  static volatile unsigned int mSelectorFiltered; // 8x the averaged ADC value
+  static volatile byte mSelectorCandidate;
+  static volatile byte mSelectorSettleCount;
+  static volatile byte mSelectorMode;
+  
+  static byte mSelectorChannel;
+  static byte mAuxChannel;
+  static void (*mAuxHandler)(const int sample);
+  static volatile bool mSamplingAux; // Conversion in progress is for the aux input
 };
 
 #endif
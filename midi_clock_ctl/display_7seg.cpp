@@ -19,12 +19,13 @@
 */
 #include "display_7seg.h"
 
+// In display() calls: 1 s at one digit every 1 ms
 #define MSG_DURATION 1000
 
 Display7Seg::Display7Seg(const int dataPin, const int latchPin, const int clockPin)
 : 
 mDataPin(dataPin), mLatchPin(latchPin), mClockPin(clockPin),
-mCurrentDigit(0), mCurrentMsgDuration(0)
+mCurrentDigit(0), mBeatFlash(MidiProxy::NoFlash), mCurrentMsgDuration(0)
 {
 }
 
@@ -43,33 +44,37 @@ void Display7Seg::setup()
 
   for( int i = 0; i < NUM_DIGITS; ++i )
   {
-    mLedData[i] = -1;
-    mMsgData[i] = -1;
+    mLedData[i] = DISPLAY_NO_DATA;
+    mMsgData[i] = DISPLAY_NO_DATA;
   }
 }
 
 void Display7Seg::display()
 {
-  if( mMsgData[mCurrentDigit] < 0 && mLedData[mCurrentDigit] < 0 )
+  if( mMsgData[mCurrentDigit] == DISPLAY_NO_DATA && mLedData[mCurrentDigit] == DISPLAY_NO_DATA )
     return;
     
   // take the latchPin low so 
   // the LEDs don't change while you're sending in bits:
   digitalWrite(mLatchPin, LOW);
 
-  shiftOut(mDataPin, mClockPin, LSBFIRST, mDigitsCodes[mCurrentDigit]);
+  shiftOut(mDataPin, mClockPin, LSBFIRST, pgm_read_byte(&mDigitsCodes[mCurrentDigit]));
   
-  if( mMsgData[mCurrentDigit] >= 0 )
+  const bool beatDot = (mBeatFlash != MidiProxy::NoFlash && mCurrentDigit == (NUM_DIGITS - 1))
+                      || (mBeatFlash == MidiProxy::DownbeatFlash && mCurrentDigit == 0);
+  
+  if( mMsgData[mCurrentDigit] != DISPLAY_NO_DATA )
   {
     // There is a msg to display instead of number
-    const int number = mMsgData[mCurrentDigit];
+    const byte number = beatDot ? mMsgData[mCurrentDigit] | mSeparatorCode
+                                : mMsgData[mCurrentDigit];
     shiftOut(mDataPin, mClockPin, LSBFIRST, number);
   }
-  else if( mLedData[mCurrentDigit] >= 0 )
+  else if( mLedData[mCurrentDigit] != DISPLAY_NO_DATA )
   {
     // put a comma after 3 digits:
-    const int number = mCurrentDigit == 2 ? mLedData[mCurrentDigit] | mSeparatorCode
-                                          : mLedData[mCurrentDigit];
+    const byte number = (mCurrentDigit == 2 || beatDot) ? mLedData[mCurrentDigit] | mSeparatorCode
+                                                        : mLedData[mCurrentDigit];
     shiftOut(mDataPin, mClockPin, LSBFIRST, number);
   }
   
@@ -83,7 +88,7 @@ void Display7Seg::display()
     
   if( mCurrentMsgDuration < MSG_DURATION )
     ++mCurrentMsgDuration;
-  else if( mLedData[mCurrentDigit] >= 0 ) // Only reset if there is a number to display
+  else if( mLedData[mCurrentDigit] != DISPLAY_NO_DATA ) // Only reset if there is a number to display
     resetMsg();                         // instead (could happen that there is none right after init)
 }
 
@@ -104,37 +109,44 @@ void Display7Seg::setNumber(const unsigned int number)
 
 void Display7Seg::setNumber(const byte digit1, const byte digit2, const byte digit3, const byte digit4)
 {
-  mLedData[0] = mNumbersCodes[ constrain(digit1, 0, 9) ];
-  mLedData[1] = mNumbersCodes[ constrain(digit2, 0, 9) ];
-  mLedData[2] = mNumbersCodes[ constrain(digit3, 0, 9) ];
-  mLedData[3] = mNumbersCodes[ constrain(digit4, 0, 9) ];
+  mLedData[0] = pgm_read_byte(&mNumbersCodes[ constrain(digit1, 0, 9) ]);
+  mLedData[1] = pgm_read_byte(&mNumbersCodes[ constrain(digit2, 0, 9) ]);
+  mLedData[2] = pgm_read_byte(&mNumbersCodes[ constrain(digit3, 0, 9) ]);
+  mLedData[3] = pgm_read_byte(&mNumbersCodes[ constrain(digit4, 0, 9) ]);
 }
 
-void Display7Seg::setStatusMsg(const char* msg)
+void Display7Seg::setStatusMsg(const __FlashStringHelper* msg)
 {
+  const char * p = reinterpret_cast<const char *>(msg);
   mCurrentMsgDuration = 0;
   for( int i = 0; i < NUM_DIGITS; ++i )
   {
-    mMsgData[i] = mLettersCodes[ constrain(msg[i] - 'a', 0, 25) ];
+    const char letter = pgm_read_byte(p + i);
+    mMsgData[i] = pgm_read_byte(&mLettersCodes[ constrain(letter - 'a', 0, 25) ]);
   }
 }
 
+void Display7Seg::setBeatFlash(const MidiProxy::BeatFlashState flash)
+{
+  mBeatFlash = flash;
+}
+
 void Display7Seg::resetMsg()
 {
   for( int i = 0; i < NUM_DIGITS; ++i )
   {
-    mMsgData[i] = -1;
+    mMsgData[i] = DISPLAY_NO_DATA;
   }
 }
 
-const int Display7Seg::mDigitsCodes[NUM_DIGITS] = { 
+const byte Display7Seg::mDigitsCodes[NUM_DIGITS] PROGMEM = { 
   B10000000,
   B01000000,
   B00100000,
   B00010000
 };
 
-const int Display7Seg::mNumbersCodes[10] = { 
+const byte Display7Seg::mNumbersCodes[10] PROGMEM = { 
   B11111100, // 0
   B01100000, // 1
   B11011010, // 2
@@ -147,7 +159,7 @@ const int Display7Seg::mNumbersCodes[10] = {
   B11110110  // 9
 };
 
-const int Display7Seg::mLettersCodes[26] = { 
+const byte Display7Seg::mLettersCodes[26] PROGMEM = { 
   B11101110, // A
   B00111110, // b
   B10011100, // C
@@ -175,7 +187,3 @@ const int Display7Seg::mLettersCodes[26] = {
   B01110000, // y - approximative :/
   B01100110, // Z - not possible
 };
-
-const int Display7Seg::mSeparatorCode = B00000001; // comma to be bitwise OR'd with any number
-
-
@@ -21,8 +21,11 @@
 #define _MIDI_CLOCK_CTL_DISPLAY_7SEG_H_
 
 #include <Arduino.h>
+#include "midi_proxy.h"
 
 #define NUM_DIGITS 4
+// Segment code meaning there's nothing to display on a digit
+#define DISPLAY_NO_DATA 0xFF
 
 class Display7Seg
 {
@@ -33,34 +36,41 @@ class Display7Seg
   // To be called on main program setup
   void setup();
   
-  // To be called in main loop function
+  // To be called at a fixed rate (one digit per call, 1 ms for 250 Hz refresh):
+  // digits are lit for the same time whatever the loop is doing
   void display();
   
   void setNumber(const float numberToDisplay);
   void setNumber(const unsigned int numberToDisplay);
   
   /// Can display momentaneous 4 letters msg instead of number
-  /// \param[in] msg has to be lowercase ascii. Expected to be of size NUM_DIGITS
+  /// \param[in] msg has to be lowercase ascii, in flash (use F()). Expected to be of size NUM_DIGITS
   /// \See mLettersCodes for supported letters 
-  void setStatusMsg(const char* msg);
+  void setStatusMsg(const __FlashStringHelper* msg);
+  
+  /// Lights decimal points as a visual metronome: last digit on beats,
+  /// first one too on downbeats (see MidiProxy::getBeatFlash)
+  void setBeatFlash(const MidiProxy::BeatFlashState flash);
   
  private:
   void setNumber(const byte digit1, const byte digit2, const byte digit3, const byte digit4);
   void resetMsg();
   
  private:
-  const int mDataPin;
-  const int mLatchPin; /* ST_CP of 74HC595 */
-  const int mClockPin; /* SH_CP of 74HC595 */
+  const byte mDataPin;
+  const byte mLatchPin; /* ST_CP of 74HC595 */
+  const byte mClockPin; /* SH_CP of 74HC595 */
   byte mCurrentDigit;
+  byte mBeatFlash;  // MidiProxy::BeatFlashState
   int mCurrentMsgDuration;
-  int mLedData[NUM_DIGITS];
-  int mMsgData[NUM_DIGITS];
+  byte mLedData[NUM_DIGITS];
+  byte mMsgData[NUM_DIGITS];
   
-  static const int mNumbersCodes[10];
-  static const int mLettersCodes[26];
-  static const int mDigitsCodes[NUM_DIGITS];
-  static const int mSeparatorCode;
+  // Segment tables are in flash (PROGMEM)
+  static const byte mNumbersCodes[10];
+  static const byte mLettersCodes[26];
+  static const byte mDigitsCodes[NUM_DIGITS];
+  static const byte mSeparatorCode = B00000001; // comma to be bitwise OR'd with any number
 };
 
 #endif
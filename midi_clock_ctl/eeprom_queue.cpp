@@ -0,0 +1,155 @@
+/*                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                      /*
+ MidiClockCtl : MIDI controller (Time Clock) with rotary encoder, 4 digit 7seg display and footswitches.
+ Copyright (C) 2013 Adrien Anselme
+
+ This file is part of MidiClockCtl.
+
+ MidiClockCtl is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 2 of the License, or
+ (at your option) any later version.
+
+ MidiClockCtl is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with MidiClockCtl.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include "eeprom_queue.h"
+#include <avr/eeprom.h>
+
+// The queue is only shared with the EEPROM ready interrupt: masking that one
+// (single instruction) is enough, the others keep running
+bool EepromQueue::write(const int address, const byte value)
+{
+  EECR &= ~(1 << EERIE);
+  const bool queued = queue(address, value);
+  resume();
+  return queued;
+}
+
+bool EepromQueue::write(const int address, const byte * data, const byte length)
+{
+  EECR &= ~(1 << EERIE);
+  // Coalesced bytes don't take room: only count the new ones
+  byte needed = length;
+  for( byte i = 0; i < length; ++i )
+  {
+    for( byte j = 0; j < mCount; ++j )
+    {
+      if( mAddresses[(mHead + j) % EEPROM_QUEUE_SIZE] == address + i )
+      {
+        --needed;
+        break;
+      }
+    }
+  }
+  
+  const bool hasRoom = (needed <= EEPROM_QUEUE_SIZE - mCount);
+  if( hasRoom )
+  {
+    for( byte i = 0; i < length; ++i )
+      queue(address + i, data[i]);
+  }
+  resume();
+  return hasRoom;
+}
+
+// Interrupt fires as soon as the EEPROM is ready (right away if idle).
+// Queue entries aren't volatile: the barrier keeps their stores before it
+void EepromQueue::resume()
+{
+  asm volatile("" ::: "memory");
+  if( mCount > 0 )
+    EECR |= (1 << EERIE);
+}
+
+// With the EEPROM ready interrupt masked
+bool EepromQueue::queue(const int address, const byte value)
+{
+  for( byte i = 0; i < mCount; ++i )
+  {
+    const byte pos = (mHead + i) % EEPROM_QUEUE_SIZE;
+    if( mAddresses[pos] == address )
+    {
+      mValues[pos] = value;
+      return true;
+    }
+  }
+  
+  if( mCount >= EEPROM_QUEUE_SIZE )
+    return false;
+  
+  const byte pos = (mHead + mCount) % EEPROM_QUEUE_SIZE;
+  mAddresses[pos] = address;
+  mValues[pos] = value;
+  ++mCount;
+  return true;
+}
+
+byte EepromQueue::read(const int address)
+{
+  // Also keeps the interrupt away from the address register while reading
+  EECR &= ~(1 << EERIE);
+  for( byte i = 0; i < mCount; ++i )
+  {
+    const byte pos = (mHead + i) % EEPROM_QUEUE_SIZE;
+    if( mAddresses[pos] == address )
+    {
+      const byte value = mValues[pos];
+      resume();
+      return value;
+    }
+  }
+  
+  const byte value = eeprom_read_byte(reinterpret_cast<const uint8_t *>(address));
+  resume();
+  return value;
+}
+
+byte EepromQueue::available()
+{
+  return EEPROM_QUEUE_SIZE - mCount;
+}
+
+bool EepromQueue::isIdle()
+{
+  return mCount == 0 && !(EECR & (1 << EEPE));
+}
+
+// Called when the EEPROM is ready: previous write (if any) is over
+void EepromQueue::doWriteNext()
+{
+  if( mCount == 0 )
+  {
+    EECR &= ~(1 << EERIE);
+    return;
+  }
+  
+  const unsigned int address = mAddresses[mHead];
+  const byte value = mValues[mHead];
+  mHead = (mHead + 1) % EEPROM_QUEUE_SIZE;
+  --mCount;
+  
+  EEAR = address;
+  EECR |= (1 << EERE);
+  if( EEDR == value )
+    return; // Unchanged, the interrupt comes back right away for the next one
+  
+  // Erase and write: EEPE must be set within 4 cycles of EEMPE
+  EEDR = value;
+  EECR |= (1 << EEMPE);
+  EECR |= (1 << EEPE);
+}
+
+ISR(EE_READY_vect)
+{
+  EepromQueue::doWriteNext();
+}
+
+unsigned int EepromQueue::mAddresses[EEPROM_QUEUE_SIZE];
+byte EepromQueue::mValues[EEPROM_QUEUE_SIZE];
+volatile byte EepromQueue::mHead = 0;
+volatile byte EepromQueue::mCount = 0;
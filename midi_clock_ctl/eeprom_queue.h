@@ -0,0 +1,67 @@
+/*                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                      /*
+ MidiClockCtl : MIDI controller (Time Clock) with rotary encoder, 4 digit 7seg display and footswitches.
+ Copyright (C) 2013 Adrien Anselme
+
+ This file is part of MidiClockCtl.
+
+ MidiClockCtl is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 2 of the License, or
+ (at your option) any later version.
+
+ MidiClockCtl is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with MidiClockCtl.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef _MIDI_CLOCK_CTL_EEPROM_QUEUE_H_
+#define _MIDI_CLOCK_CTL_EEPROM_QUEUE_H_
+
+#include <Arduino.h>
+
+// Pending byte writes, 3 bytes of RAM each: room for a snapshot slot,
+// the tempo and the clock trim at the same time
+#define EEPROM_QUEUE_SIZE 20
+
+/////////////////////////////////////
+// Write-behind EEPROM: write() only queues the byte and returns, the
+// EEPROM ready interrupt programs queued bytes one at a time (3.3 ms each)
+// in the order they were queued. Writing an address already queued replaces
+// its value. Bytes already holding their value are skipped.
+// All EEPROM accesses must go through here once writes are queued: the
+// interrupt uses the EEPROM address and data registers.
+class EepromQueue
+{
+public:
+  /// False if the queue is full (nothing queued)
+  static bool write(const int address, const byte value);
+  /// All bytes or nothing, false if there isn't room for all of them
+  static bool write(const int address, const byte * data, const byte length);
+  
+  /// Latest value written: queued one if any. Waits for the byte being
+  /// programmed if there is one (up to 3.3 ms): not meant for the main loop
+  static byte read(const int address);
+  
+  /// Room left in the queue
+  static byte available();
+  static bool isIdle();
+  
+  /// EEPROM ready interrupt
+  static void doWriteNext();
+  
+private:
+  static bool queue(const int address, const byte value);
+  static void resume();
+  
+private:
+  // Note:  all variables changed within interrupts are volatile
+  static unsigned int mAddresses[EEPROM_QUEUE_SIZE];
+  static byte mValues[EEPROM_QUEUE_SIZE];
+  static volatile byte mHead;
+  static volatile byte mCount;
+};
+
+#endif
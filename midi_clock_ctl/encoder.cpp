@@ -19,6 +19,7 @@
 */
 #include "encoder.h"
 #include "Arduino.h"
+#include "trace.h"
 
 Encoder::Encoder(const int encoderPinB)
 {
@@ -36,28 +37,34 @@ void Encoder::setup(const unsigned int minValue, const unsigned int maxValue, co
   attachInterrupt(0, Encoder::doEncoder, CHANGE); // encoder pin on interrupt 0 (pin 2)
   attachInterrupt(1, Encoder::doEncoder, CHANGE); // encoder pin on interrupt 1 (pin 3)
   
-  val1 = val2 = oldVal1 = oldVal2 = pos = oldPos = turn = oldTurn = turnCount = 0;
+  val1 = val2 = oldVal1 = oldVal2 = pos = oldPos = turn = turnCount = 0;
   mMinVal = minValue;
   mMaxVal = maxValue;
   mEncoderPos = defaultValue;
 }
 
+// Interrupts stay on (the MIDI clock must not wait): read again if a step
+// was counted in the middle of the two bytes
 const unsigned int Encoder::readValue() const
 {
-  unsigned int temp = 0;
-
-  noInterrupts(); // Ensures interrupt doesn't happen while reading the value
-  temp = mEncoderPos;
-  interrupts();
+  byte sequence;
+  unsigned int temp;
+  do
+  {
+    sequence = mSequence;
+    temp = mEncoderPos;
+  } while( (sequence & 1) || sequence != mSequence );
 
   return temp;
 }
 
+// Only the encoder interrupts are held back while writing
 void Encoder::setValue(const unsigned int newValue)
 {
-  noInterrupts(); // Ensures interrupt doesn't happen while reading the value
+  const byte savedMask = EIMSK;
+  EIMSK = savedMask & ~((1 << INT0) | (1 << INT1));
   mEncoderPos = newValue;
-  interrupts();
+  EIMSK = savedMask;
 }
 
 const unsigned int Encoder::getMinVal() const
@@ -77,7 +84,10 @@ const int Encoder::getStep()
 
 void Encoder::setStep(const int newStep)
 {
+  const byte savedMask = EIMSK;
+  EIMSK = savedMask & ~((1 << INT0) | (1 << INT1));
   mStep = newStep;
+  EIMSK = savedMask;
 }
 
 void Encoder::doEncoder() 
@@ -109,18 +119,26 @@ void Encoder::doEncoder()
     
     if (pos == 0)
     {
-      // only assume a complete step on stationary position
+      // only assume a complete step on stationary position.
+      // Odd sequence while the value changes, see readValue()
+      ++mSequence;
       if(turnCount > 0)
+      {
         dec(mEncoderPos, mStep); // CCW
+        Trace::recordIsr(Trace::EncoderTurn, 0xFF);
+      }
       else if(turnCount < 0)
+      {
         inc(mEncoderPos, mStep); // CW
+        Trace::recordIsr(Trace::EncoderTurn, 1);
+      }
       turnCount = 0;
+      ++mSequence;
     }
     
     oldVal1 = val1;
     oldVal2 = val2;
     oldPos  = pos;
-    oldTurn = turn;
   }
 }
 
@@ -139,23 +157,24 @@ void Encoder::inc(volatile unsigned int & value, volatile int & stepVal)
 
 void Encoder::dec(volatile unsigned int & value, volatile int & stepVal)
 {
-  value = max(mMinVal, value - stepVal);
+  // Unsigned: don't go below 0 on the way to the minimum
+  value = (value >= mMinVal + stepVal) ? value - stepVal : mMinVal;
 }
 
 unsigned int Encoder::mMinVal = 0;
 unsigned int Encoder::mMaxVal = 0;
-int Encoder::mEncoderPinA = 2;
-int Encoder::mEncoderPinB = 0;
+byte Encoder::mEncoderPinA = 2;
+byte Encoder::mEncoderPinB = 0;
 volatile int Encoder::mStep = 0;
 volatile unsigned int Encoder::mEncoderPos = 0;
-
-volatile int Encoder::val1 = 0;
-volatile int Encoder::val2 = 0;
-volatile int Encoder::oldVal1 = 0;
-volatile int Encoder::oldVal2 = 0;
-volatile int Encoder::pos = 0;
-volatile int Encoder::oldPos = 0;
-volatile int Encoder::turn = 0;
-volatile int Encoder::oldTurn = 0;
-volatile int Encoder::turnCount = 0;
+volatile byte Encoder::mSequence = 0;
+
+volatile byte Encoder::val1 = 0;
+volatile byte Encoder::val2 = 0;
+volatile byte Encoder::oldVal1 = 0;
+volatile byte Encoder::oldVal2 = 0;
+volatile byte Encoder::pos = 0;
+volatile byte Encoder::oldPos = 0;
+volatile int8_t Encoder::turn = 0;
+volatile int8_t Encoder::turnCount = 0;
 
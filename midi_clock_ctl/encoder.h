@@ -20,6 +20,8 @@
 #ifndef _MIDI_CLOCK_CTL_ENCODER_H_
 #define _MIDI_CLOCK_CTL_ENCODER_H_
 
+#include <Arduino.h>
+
 /////////////////// Rotary encoder stuff
 class Encoder
 {
@@ -47,16 +49,18 @@ class Encoder
 
   private:
     static unsigned int mMinVal, mMaxVal;
-    static int mEncoderPinA, mEncoderPinB;
+    static byte mEncoderPinA, mEncoderPinB;
     
     // Note:  all variables changed within interrupts are volatile
     static volatile int mStep;
     static volatile unsigned int mEncoderPos;
+    static volatile byte mSequence;  // Changed before and after mEncoderPos
     
-    static volatile int val1, val2;
-    static volatile int oldVal1, oldVal2;
-    static volatile int pos, oldPos;
-    static volatile int turn, oldTurn, turnCount;
+    // Quadrature state: pin levels, position out of four and partial turns all fit a byte
+    static volatile byte val1, val2;
+    static volatile byte oldVal1, oldVal2;
+    static volatile byte pos, oldPos;
+    static volatile int8_t turn, turnCount;
 };
 
 #endif
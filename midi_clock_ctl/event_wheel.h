@@ -0,0 +1,113 @@
+/*                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                      /*
+ MidiClockCtl : MIDI controller (Time Clock) with rotary encoder, 4 digit 7seg display and footswitches.
+ Copyright (C) 2013 Adrien Anselme
+
+ This file is part of MidiClockCtl.
+
+ MidiClockCtl is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 2 of the License, or
+ (at your option) any later version.
+
+ MidiClockCtl is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with MidiClockCtl.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef _MIDI_CLOCK_CTL_EVENT_WHEEL_H_
+#define _MIDI_CLOCK_CTL_EVENT_WHEEL_H_
+
+#include <Arduino.h>
+
+// Returned when nothing is due
+#define EVENT_WHEEL_NONE 0xFF
+
+/////////////////////////////////////
+// Main loop work (display, buttons, pages, timeouts...) at absolute times
+// of a free-running timer, micros() (Timer0). The next deadline of a
+// periodic event is its last deadline plus its period, not the time it
+// actually ran: lateness shows up as jitter but never accumulates as drift,
+// and is bounded by the longest event run in between. One-shot events are
+// timeouts, moved forward by scheduling them again.
+// Clock and MTC output don't go through here: the Timer1 compare
+// interrupts already fire at absolute times, without any loop delay.
+// Size is the number of events, numbered from 0 (e.g. an enum ending with a count).
+template <byte Size>
+class EventWheel
+{
+public:
+  EventWheel() : mActive(0)
+  {
+    static_assert(Size <= 8, "mActive holds one bit per event");
+  }
+  
+  /// Runs event every periodUs, first at firstTime (e.g. micros() plus an
+  /// offset, so events with the same period don't fall together)
+  void schedule(const byte event, const unsigned long periodUs, const unsigned long firstTime)
+  {
+    mPeriod[event] = periodUs;
+    mDeadline[event] = firstTime;
+    mActive |= 1 << event;
+  }
+  
+  /// Runs event once at time, replacing any deadline it had
+  void scheduleOnce(const byte event, const unsigned long time)
+  {
+    schedule(event, 0, time);
+  }
+  
+  void cancel(const byte event)
+  {
+    mActive &= ~(1 << event);
+  }
+  
+  /// True until a one-shot event is returned by nextDue() or cancelled
+  bool isPending(const byte event) const
+  {
+    return mActive & (1 << event);
+  }
+  
+  /// Due event with the earliest deadline (lowest number first on a tie),
+  /// or EVENT_WHEEL_NONE. Its next deadline is set: one event per call,
+  /// so the caller decides how much runs between its own work.
+  /// Periods missed altogether are skipped, not run in a burst
+  const byte nextDue(const unsigned long now)
+  {
+    // Timestamps wrap (every 71 minutes): compare differences only
+    byte event = EVENT_WHEEL_NONE;
+    unsigned long lateness = 0;
+    for( byte i = 0; i < Size; ++i )
+    {
+      if( !isPending(i) )
+        continue;
+      const unsigned long late = now - mDeadline[i];
+      if( static_cast<long>(late) >= 0 && (event == EVENT_WHEEL_NONE || late > lateness) )
+      {
+        event = i;
+        lateness = late;
+      }
+    }
+    if( event == EVENT_WHEEL_NONE )
+      return EVENT_WHEEL_NONE;
+    
+    const unsigned long period = mPeriod[event];
+    if( period == 0 )
+      cancel(event);
+    // Same grid as before, past the current time
+    else if( lateness < period )
+      mDeadline[event] += period;
+    else
+      mDeadline[event] += (lateness / period + 1) * period;
+    return event;
+  }
+  
+private:
+  unsigned long mPeriod[Size];    // 0 for one-shot events
+  unsigned long mDeadline[Size];
+  byte mActive;                   // Bit per scheduled event
+};
+
+#endif
@@ -22,6 +22,9 @@
  * digital in 1 connected to MIDI jack pin 5
  * MIDI jack pin 2 connected to ground
  * MIDI jack pin 4 connected to +5V through 220-ohm resistor
+ * Optional kick drum trigger (piezo or line, biased at 2.5V) on a spare analog pin, see BoardConfig::AutoTempoPin
+ * LED on digital pin 13 (on-board) flashing on beats in clock mode
+ * MIDI IN jack (through an optocoupler) connected to digital in 0, merged to the output
  * digital pin 2 connected to rotary encoder pin 1 (required for interruption)
  * encoder pin 2 connected to ground
  * encoder pin 3 connected to any digital pin (e.g. digital pin 3) 
@@ -30,10 +33,63 @@
 #include "controls.h"
 #include "display_7seg.h"
 #include "midi_proxy.h"
-#include <EEPROM.h>
-
+#include "midi_merge.h"
+#include "onset.h"
+#include "trace.h"
+#include "calibration.h"
+#include "snapshot.h"
+#include "mtc_chase.h"
+#include "click.h"
+#include "eeprom_queue.h"
+#include "control_stream.h"
+#include "event_wheel.h"
+
+// Encoder accelerates while turned again within this, ms
 #define ACCEL_TIME_DELTA 200
 
+// Transport buttons take effect on the next beat (or bar) of the clock
+#define TRANSPORT_QUANTIZE MidiProxy::QuantizeBeat
+#define BEATS_PER_BAR 4
+// Time given to slaves between Start/Continue and the first clock
+#define START_PREROLL_US 1000
+// Max number of position / program change messages per second while the encoder turns
+#define ENCODER_MSG_RATE 20
+// Don't forward clock and transport from MIDI in, we are the master
+#define MERGE_FILTER_CLOCK true
+// Holding both buttons dumps the event trace (see TRACE_ENABLED in trace.h)
+#define TRACE_CHORD_BTN_A 6
+#define TRACE_CHORD_BTN_B 7
+// Long press starts / ends clock calibration
+#define CALIBRATION_BTN 4
+// CPU clock trim: marker byte then ppm as 16 bit, after the BPM
+#define EEPROM_TRIM_ADDR 2
+#define EEPROM_TRIM_MARKER 0xA5
+// Runtime state saved for fast resume after a power loss
+#define EEPROM_SNAPSHOT_ADDR 16
+// Position save period while playing. Mode and transport changes are saved
+// right away, tempo changes once it stays put for SNAPSHOT_TEMPO_SETTLE_MS
+#define SNAPSHOT_INTERVAL_MS 5000UL
+#define SNAPSHOT_TEMPO_SETTLE_MS 3000UL
+// Send the boot time (reset to clock running) as F0 7D 42 <4 x 7 bits, us> F7
+#define REPORT_BOOT_TIME true
+// Timecode of the song start when chasing MTC: hours, minutes, seconds, frames
+#define CHASE_START_TIME 1, 0, 0, 0
+// Controller streamed by the control page, see BoardConfig::StreamControlPage
+#define CONTROL_STREAM_FORMAT ControlStream::Cc14
+#define CONTROL_STREAM_CHANNEL 1
+#define CONTROL_STREAM_PARAMETER 16 // General purpose 1 (LSB on 48)
+// Share of the MIDI bandwidth it may use, percent
+#define CONTROL_STREAM_SHARE 25
+// Encoder step, out of 16384, before acceleration
+#define CONTROL_STREAM_STEP 32
+// Click sound, see BoardConfig::HasClick
+#define CLICK_SOUND Click::Tone
+// Periodic loop work, see EventWheel. Periods in microseconds
+#define PAGE_PERIOD_US 1000
+#define BUTTONS_PERIOD_US 1000
+#define DISPLAY_PERIOD_US 1000
+#define SNAPSHOT_CHECK_PERIOD_US 10000
+
 #define BTN1_SHORT_CC 24
 #define BTN1_LONG_CC 23
 #define BTN2_SHORT_CC 25
@@ -41,21 +97,63 @@
 #define BTN3_SHORT_CC 27
 #define BTN3_LONG_CC 28
 
+/// Pin map and features, fixed at compile time. Code of disabled features
+/// is left out of the firmware, their selector position falls back to
+/// the first enabled mode.
+struct BoardConfig
+{
+  static constexpr int EncoderPin = 3;
+  static constexpr int Btn1Pin = 5;
+  static constexpr int Btn2Pin = 6;
+  static constexpr int Btn3Pin = 7;
+  static constexpr int Btn4Pin = 8;
+  static constexpr int Btn5Pin = A2;
+  static constexpr int Btn6Pin = A3;
+  static constexpr int Btn7Pin = A4;
+  static constexpr int SelectorPin = A0;
+  static constexpr int LedDataPin = 4;
+  static constexpr int LedLatchPin = 10;
+  static constexpr int LedClockPin = 9;
+  // Flashes on every beat in clock mode (on-board LED)
+  static constexpr int BeatLedPin = 13;
+  // Tempo follows a kick drum trigger (piezo or line) in clock mode.
+  // Spare analog pin, or -1 to disable
+  static constexpr int AutoTempoPin = -1;
+  // 1 PPS reference (GPS receiver) for clock calibration, or -1
+  static constexpr int PpsPin = -1;
+  
+  static constexpr bool HasControlPage = true; // CC and program changes
+  static constexpr bool HasClock = true;
+  static constexpr bool HasMtc = true;
+  // Clock position also sends MTC following the song (e.g. for a lighting desk)
+  static constexpr bool ClockWithMtc = false;
+  // Clock position follows incoming MTC (e.g. from a video or audio player):
+  // playback starts, stops, locates and drifts with the timecode
+  static constexpr bool ChaseMtc = false;
+  // Metronome click on pin 11 (Timer2 PWM, see click.h) while the clock plays
+  static constexpr bool HasClick = false;
+  // Control page encoder streams a 14 bit controller (filter, FX...)
+  // instead of selecting programs
+  static constexpr bool StreamControlPage = false;
+};
+
+template <class Config>
 class Application
 {
 public:
-  Application(const float defaultBpm, const int encoderPin, const int btn1Pin, const int btn2Pin,
-              const int btn3Pin, const int btn4Pin, const int btn5Pin,
-              const int btn6Pin, const int btn7Pin, const int selectorPin,
-              const int ledDataPin, const int ledLatchPin, const int ledClockPin)
+  Application(const float defaultBpm)
   : 
     mBpm(defaultBpm), mOldBpm(0.0f), mSavedBpm(0.0f),
-    mLastUpdate(0), mLastSelectorMode(Controls::SelectorNone),
-    mIsPlaying(false), mShouldReset(true), mOldPosition(0), mOldProgram(0),
-    mEncoder(encoderPin),
-    mControls(btn1Pin, btn2Pin, btn3Pin, btn4Pin, btn5Pin, btn6Pin, btn7Pin, selectorPin),
-    mLedDisplay(ledDataPin, ledLatchPin, ledClockPin)
+    mLastSelectorMode(Controls::SelectorNone),
+    mIsPlaying(false), mShouldReset(true), mOldPosition(0), mOldProgram(0), mTraceChordHeld(false),
+    mEncoder(Config::EncoderPin),
+    mControls(Config::Btn1Pin, Config::Btn2Pin, Config::Btn3Pin, Config::Btn4Pin,
+              Config::Btn5Pin, Config::Btn6Pin, Config::Btn7Pin, Config::SelectorPin),
+    mLedDisplay(Config::LedDataPin, Config::LedLatchPin, Config::LedClockPin),
+    mSnapshots(EEPROM_SNAPSHOT_ADDR),
+    mMtcChase(mMtcReader, mMidi)
     {
+      memset(&mLastSnapshot, 0, sizeof(mLastSnapshot));
     }
 
   ~Application()
@@ -64,54 +162,181 @@ public:
 
   void setup()
   {
+    // Only what output needs comes first, so a show interrupted by a power
+    // loss resumes as soon as possible. Nothing here waits on hardware:
+    // Serial.begin only sets registers, EEPROM reads take a few cycles,
+    // the selector needs a single conversion.
+    mMidi.setup();
+    mMidi.setQuantize(TRANSPORT_QUANTIZE);
+    mMidi.setMeter(BEATS_PER_BAR);
+    mMidi.setStartPreroll(START_PREROLL_US);
+    MidiProxy::setClockTrim(recoverTrimFromEeprom());
+    
     // Buttons
+    if( Config::AutoTempoPin >= 0 )
+      mControls.setAuxInput(Config::AutoTempoPin, AutoTempo::doSample);
     mControls.setup();
     mLedDisplay.setup();
-    mMidi.setup();
 
     // Read BPM from EEPROM
     mSavedBpm = recoverBpmFromEeprom();
     if( mSavedBpm > 0.0f )
-      mEncoder.setValue( mSavedBpm * 10.0f) ;
+      mBpm = mSavedBpm;
+    
+    Snapshot snapshot;
+    const bool hasSnapshot = mSnapshots.restore(snapshot);
+    if( hasSnapshot && snapshot.bpmTen > 0 )
+      mBpm = snapshot.bpmTen / 10.0f;
     
     // Encoder setup is done in checkSelector
     checkSelector(true);
+    if( hasSnapshot )
+      resume(snapshot);
+    
+    const unsigned long bootTime = micros();
+    
+    mMidi.setMaxQueuedRate(ENCODER_MSG_RATE);
+    mMerge.setClockFilter(MERGE_FILTER_CLOCK);
+    mMidi.setBeatLed(Config::BeatLedPin);
+    if( Config::StreamControlPage )
+    {
+      mControlStream.setup(CONTROL_STREAM_FORMAT, CONTROL_STREAM_CHANNEL,
+                           CONTROL_STREAM_PARAMETER, CONTROL_STREAM_SHARE);
+      mMerge.setControlStream(&mControlStream);
+    }
+    if( Config::HasClick )
+    {
+      Click::setup(CLICK_SOUND);
+      mMidi.setBeatHandler(Click::trigger);
+    }
+    mCalibration.setPpsPin(Config::PpsPin);
+    mMerge.setCalibration(&mCalibration);
+    if( Config::ChaseMtc )
+    {
+      mMerge.setMtcReader(&mMtcReader);
+      mMtcChase.setStartTime(CHASE_START_TIME);
+    }
+    if( REPORT_BOOT_TIME )
+      reportBootTime(bootTime);
 
-    mLastUpdate = millis();
+
+    // Offsets spread tasks of the same period over it
+    const unsigned long now = micros();
+    mWheel.schedule(TaskPage, PAGE_PERIOD_US, now);
+    mWheel.schedule(TaskButtons, BUTTONS_PERIOD_US, now + BUTTONS_PERIOD_US / 3);
+    mWheel.schedule(TaskDisplay, DISPLAY_PERIOD_US, now + DISPLAY_PERIOD_US * 2 / 3);
+    mWheel.schedule(TaskSnapshot, SNAPSHOT_CHECK_PERIOD_US, now);
+    mWheel.schedule(TaskSavePosition, SNAPSHOT_INTERVAL_MS * 1000UL, now + SNAPSHOT_INTERVAL_MS * 1000UL);
   }
 
   void loop()
   {
+    // MIDI thru first, for lowest latency
+    mMerge.update();
+    
     const Controls::SelectorMode currentMode = checkSelector();
+    
+    // Rate limited encoder messages
+    mMidi.update();
+    // Polls the PPS pin and dumps the trace as fast as possible
+    mCalibration.update();
+    Trace::update();
+    
+    // At most one periodic task per pass, so MIDI thru never waits for more than one
+    switch( mWheel.nextDue(micros()) )
+    {
+      case TaskPage:
+        updatePage(currentMode);
+        break;
+      case TaskButtons:
+        checkButtons(currentMode);
+        checkTraceChord();
+        break;
+      case TaskDisplay:
+        mLedDisplay.setBeatFlash(MidiProxy::getBeatFlash());
+        mLedDisplay.display();
+        break;
+      case TaskSnapshot:
+        saveSnapshot(false);
+        mSnapshots.update();
+        break;
+      case TaskSaveTempo:
+        saveSnapshot(true);
+        break;
+      case TaskSavePosition:
+        if( mMidi.isPlaying() )
+          saveSnapshot(true);
+        break;
+      case TaskDecelerate:
+        mEncoder.setStep((Config::StreamControlPage && currentMode == Controls::SelectorNone)
+                         ? CONTROL_STREAM_STEP : 1);
+        break;
+    }
+  }
 
-    if( currentMode == Controls::SelectorFirst )
+private:
+  // Loop work and timeouts, see mWheel
+  enum LoopTask
+  {
+    TaskPage = 0,     // Encoder to the current page (tempo, position, control)
+    TaskButtons,
+    TaskDisplay,      // One digit per run
+    TaskSnapshot,     // Mode and transport changes, EEPROM queue
+    TaskSavePosition, // Every SNAPSHOT_INTERVAL_MS, if playing
+    TaskDecelerate,   // One-shot: encoder not turned for ACCEL_TIME_DELTA
+    TaskSaveTempo,    // One-shot: tempo unchanged for SNAPSHOT_TEMPO_SETTLE_MS
+    TaskCount
+  };
+  
+  void updatePage(const Controls::SelectorMode currentMode)
+  {
+    // Feature flags first: disabled modes are folded away by the compiler
+    if( Config::HasClock && currentMode == Controls::SelectorFirst )
+    {
+      if( Config::AutoTempoPin >= 0 )
+        setBpmFromAutoTempo();
       setBpmFromEncoder();
-    else if( currentMode == Controls::SelectorSecond )
+      if( Config::ChaseMtc )
+      {
+        mMtcChase.setBpm(mBpm);
+        mMtcChase.update(micros());
+      }
+    }
+    else if( Config::HasMtc && currentMode == Controls::SelectorSecond )
       setPositionFromEncoder();
-    else
-      setCurrentProgramFromEncoder();
-      
-    checkButtons(currentMode);
-
-    // Display
-    mLedDisplay.display();
+    else if( Config::HasControlPage && currentMode == Controls::SelectorNone )
+    {
+      if( Config::StreamControlPage )
+        setStreamFromEncoder();
+      else
+        setCurrentProgramFromEncoder();
+    }
   }
 
 private:
   float mBpm;
   float mOldBpm;
   float mSavedBpm;
-  unsigned long mLastUpdate;
   Controls::SelectorMode mLastSelectorMode;
   bool mIsPlaying;
   bool mShouldReset;
   unsigned int mOldPosition;
   byte mOldProgram;
+  bool mTraceChordHeld;
+  Snapshot mLastSnapshot;
   //
   Encoder mEncoder;
   Controls mControls;
   Display7Seg mLedDisplay;
   MidiProxy mMidi;
+  MidiMerge mMerge;
+  AutoTempo mAutoTempo;
+  ClockCalibration mCalibration;
+  SnapshotStore mSnapshots;
+  MtcReader mMtcReader;
+  MtcChase mMtcChase;
+  ControlStream mControlStream;
+  EventWheel<TaskCount> mWheel;
 
 private:
   float recoverBpmFromEeprom() //const
@@ -121,7 +346,7 @@ private:
     
     for( int i = 0; i < sizeof(bpmTen); ++i )
     {
-      *p = EEPROM.read( i );
+      *p = EepromQueue::read( i );
       ++p;
     }
     return bpmTen / 10.0f; 
@@ -131,19 +356,142 @@ private:
   {
     // Storing BPM*10 as big endian bytes
     const int bpmTen = static_cast<const int>(bpmToStore) * 10;
-    const byte * p = reinterpret_cast<const byte *>(&bpmTen);
+    // Programmed in background, the mode change doesn't wait
+    EepromQueue::write(0, reinterpret_cast<const byte *>(&bpmTen), sizeof(bpmTen));
+  }
+
+  /// Restarts playback saved in snapshot, if the selector is still on the same mode
+  void resume(const Snapshot & snapshot)
+  {
+    if( snapshot.mode != MidiProxy::getMode() )
+      return;
+    mLastSnapshot = snapshot;
+      
+    // Tempo already set up from the snapshot by checkSelector
+    if( Config::HasClock && MidiProxy::hasClock() )
+    {
+      if( snapshot.playing )
+      {
+        mMidi.resumeClock(snapshot.songPosition);
+        mShouldReset = false;
+      }
+    }
+    else if( Config::HasMtc && snapshot.mode == MidiProxy::SynchroMTC )
+    {
+      // Same position in the encoder, or the loop would send it again
+      const unsigned int pos = (snapshot.hours * 60 + snapshot.minutes) * 60 + snapshot.seconds;
+      mEncoder.setValue(pos);
+      mOldPosition = pos;
+      if( snapshot.playing )
+      {
+        mMidi.resumeMTC(snapshot.hours, snapshot.minutes, snapshot.seconds, snapshot.frames);
+        mShouldReset = false;
+      }
+    }
+  }
+  
+  /// Mode and transport changes are saved right away. Anything else only if
+  /// forced (settled tempo, position while playing): each save wears a slot
+  void saveSnapshot(const bool force)
+  {
+    Snapshot snapshot;
+    memset(&snapshot, 0, sizeof(snapshot));
+    snapshot.mode = MidiProxy::getMode();
+    snapshot.playing = mMidi.isPlaying();
+    snapshot.bpmTen = mBpm * 10.0f + 0.5f;
+    snapshot.songPosition = MidiProxy::getSongPosition();
+    MidiProxy::getPosition(snapshot.hours, snapshot.minutes, snapshot.seconds, snapshot.frames);
     
-    for( int i = 0; i < sizeof(bpmTen); ++i )
+    const bool stateChanged = snapshot.mode != mLastSnapshot.mode
+                           || snapshot.playing != mLastSnapshot.playing;
+    if( !stateChanged && !force )
+      return;
+    if( memcmp(&snapshot, &mLastSnapshot, sizeof(snapshot)) == 0 )
+      return;
+      
+    mSnapshots.save(snapshot);
+    mLastSnapshot = snapshot;
+  }
+  
+  /// Time from reset (Timer0 start, bootloader not included) to output running
+  void reportBootTime(const unsigned long bootTime) const
+  {
+    byte message[8];
+    message[0] = 0xF0;
+    message[1] = 0x7D;
+    message[2] = 0x42;
+    message[3] = (bootTime >> 21) & 0x7F;
+    message[4] = (bootTime >> 14) & 0x7F;
+    message[5] = (bootTime >> 7) & 0x7F;
+    message[6] = bootTime & 0x7F;
+    message[7] = 0xF7;
+    MidiProxy::writeMessage(message, 8);
+  }
+
+  long recoverTrimFromEeprom() const
+  {
+    if( EepromQueue::read(EEPROM_TRIM_ADDR) != EEPROM_TRIM_MARKER )
+      return 0;
+    const uint16_t low = EepromQueue::read(EEPROM_TRIM_ADDR + 1);
+    const uint16_t high = EepromQueue::read(EEPROM_TRIM_ADDR + 2);
+    const long ppm = static_cast<int16_t>(low | (high << 8));
+    // Same limit as calibration results
+    return (labs(ppm) <= CALIBRATION_MAX_PPM) ? ppm : 0;
+  }
+  
+  void storeTrimToEeprom(const long ppm) const
+  {
+    const int16_t value = constrain(ppm, -32000L, 32000L);
+    const byte data[3] = { EEPROM_TRIM_MARKER, static_cast<byte>(value & 0xFF),
+                           static_cast<byte>((value >> 8) & 0xFF) };
+    EepromQueue::write(EEPROM_TRIM_ADDR, data, 3);
+  }
+
+  /// Measures the CPU clock against the reference found on MIDI in (clock at
+  /// the current tempo, or MTC) or the PPS pin. Stopping applies and stores it
+  void toggleCalibration()
+  {
+    if( !mCalibration.isRunning() )
     {
-      EEPROM.write( i, *p );
-      ++p;
+      mCalibration.setReferenceBpm(mBpm);
+      mCalibration.start();
+      mLedDisplay.setStatusMsg(F("cali"));
+      return;
     }
+    
+    mCalibration.stop();
+    if( !mCalibration.hasResult() )
+    {
+      mLedDisplay.setStatusMsg(F("fail"));
+      return;
+    }
+    
+    const long ppm = mCalibration.measuredPpm();
+    MidiProxy::setClockTrim(ppm);
+    storeTrimToEeprom(ppm);
+    mLedDisplay.setStatusMsg(ppm >= 0 ? F("fast") : F("slow"));
+    mLedDisplay.setNumber(static_cast<unsigned int>(min(labs(ppm), 9999L)));
+  }
+
+  /// Selector position, or the one used in its place when its feature is disabled
+  static Controls::SelectorMode enabledMode(const Controls::SelectorMode mode)
+  {
+    const bool enabled = (mode == Controls::SelectorNone && Config::HasControlPage)
+                      || (mode == Controls::SelectorFirst && Config::HasClock)
+                      || (mode == Controls::SelectorSecond && Config::HasMtc);
+    if( enabled )
+      return mode;
+    if( Config::HasClock )
+      return Controls::SelectorFirst;
+    if( Config::HasControlPage )
+      return Controls::SelectorNone;
+    return Controls::SelectorSecond;
   }
 
   /// Read selector and apply matching sync mode
   Controls::SelectorMode checkSelector(bool forceRead = false)
   {
-    const Controls::SelectorMode currentMode = mControls.readSelector();
+    const Controls::SelectorMode currentMode = enabledMode(mControls.readSelector());
 
     if( currentMode == mLastSelectorMode && forceRead == false )
       return mLastSelectorMode;
@@ -156,30 +504,48 @@ private:
     }
     
     mLastSelectorMode = currentMode;
+    // Disabled modes never get here (see enabledMode), flags only tell the compiler
     switch( currentMode )
     {
       case Controls::SelectorNone:
       {
-        mEncoder.setup(0, 127, 0);
+        if( Config::StreamControlPage )
+        {
+          // Where the stream was left
+          mEncoder.setup(0, 0x3FFF, mControlStream.getTarget());
+          mEncoder.setStep(CONTROL_STREAM_STEP);
+        }
+        else
+          mEncoder.setup(0, 127, 0);
         mLedDisplay.setup();
-        mLedDisplay.setStatusMsg("ctrl");
-        mMidi.setMode(MidiProxy::SynchroNone);
+        mLedDisplay.setStatusMsg(F("ctrl"));
+        mMidi.setModeNone();
         return Controls::SelectorNone;
       }
       case Controls::SelectorFirst:
       {
-        mEncoder.setup(20*10 /* minbpm */, 900*10 /* maxbpm */, 120*10 /* defaultbpm */);
-        mLedDisplay.setStatusMsg("cloc");
-        mMidi.setMode(MidiProxy::SynchroClock);
+        // Starting from the current tempo (default, saved or restored)
+        mEncoder.setup(20*10 /* minbpm */, 900*10 /* maxbpm */, mBpm * 10.0f + 0.5f);
+        if( Config::ClockWithMtc )
+        {
+          mLedDisplay.setStatusMsg(F("cmtc"));
+          mMidi.setModeClockMTC();
+        }
+        else if( Config::HasClock )
+        {
+          mLedDisplay.setStatusMsg(F("cloc"));
+          mMidi.setModeClock();
+        }
         mMidi.setBpm(mBpm);
         return Controls::SelectorFirst;
       }
       case Controls::SelectorSecond:
       {
         mEncoder.setup(0, 9999, 0);
-        mLedDisplay.setStatusMsg("mtco");
+        mLedDisplay.setStatusMsg(F("mtco"));
         mMidi.sendStop();
-        mMidi.setMode(MidiProxy::SynchroMTC);
+        if( Config::HasMtc )
+          mMidi.setModeMTC();
         return Controls::SelectorSecond;
       }
     }
@@ -247,6 +613,9 @@ private:
     const Controls::ButtonMode btn1 = mControls.readBtn(1);
     const Controls::ButtonMode btn2 = mControls.readBtn(2);
     const Controls::ButtonMode btn3 = mControls.readBtn(3);
+    
+    if( mControls.readBtn(CALIBRATION_BTN) == Controls::ButtonLong )
+      toggleCalibration();
 
     if( btn1 == Controls::ButtonShort )
     {
@@ -277,16 +646,40 @@ private:
     }
   }
 
+  void checkTraceChord()
+  {
+    const bool chordHeld = mControls.isHeld(TRACE_CHORD_BTN_A) && mControls.isHeld(TRACE_CHORD_BTN_B);
+    if( chordHeld && !mTraceChordHeld )
+      Trace::requestDump();
+    mTraceChordHeld = chordHeld;
+  }
+
+  void setBpmFromAutoTempo()
+  {
+    const float newBpm = mAutoTempo.update();
+    if( newBpm > 0.0f )
+    {
+      // Same as tap tempo: through encoder value or it will be overwritten
+      mEncoder.setValue(newBpm * 10);
+    }
+  }
+
   void setBpmFromEncoder()
   {
     setBpm(mEncoder.readValue() / 10.0);
   }
   
+  /// True if the encoder was already turned within ACCEL_TIME_DELTA. Its step
+  /// goes back to the page's first one once it isn't (TaskDecelerate)
+  bool restartAccelTimeout()
+  {
+    const bool isTurning = mWheel.isPending(TaskDecelerate);
+    mWheel.scheduleOnce(TaskDecelerate, micros() + ACCEL_TIME_DELTA * 1000UL);
+    return isTurning;
+  }
+  
   void setBpm(const float newBpm)
   {
-    const unsigned long currentTime = millis();
-    const int timeDiff = currentTime - mLastUpdate;
-
     mBpm = newBpm;
 
     if(mBpm != mOldBpm)
@@ -295,28 +688,19 @@ private:
 
       mMidi.setBpm(mBpm);
       mLedDisplay.setNumber(mBpm);
+      mWheel.scheduleOnce(TaskSaveTempo, micros() + SNAPSHOT_TEMPO_SETTLE_MS * 1000UL);
 
       // Short update: accelerate encoder
-      if(timeDiff <= ACCEL_TIME_DELTA)
+      if( restartAccelTimeout() )
       {
         // increase rate 0.5 bpm after the other, with a limit of 10
         mEncoder.setStep( min(mEncoder.getStep() + 5, 100) );
       }
-      mLastUpdate = currentTime;
-    }
-
-    // No updates in a while: decelerate
-    if(timeDiff > ACCEL_TIME_DELTA)
-    {
-      mEncoder.setStep(1);
     }
   }
   
   void setPositionFromEncoder()
   {
-    const unsigned long currentTime = millis();
-    const int timeDiff = currentTime - mLastUpdate;
-    
     const unsigned int pos = mEncoder.readValue();
 
     if(pos != mOldPosition)
@@ -326,22 +710,15 @@ private:
       const unsigned int mins = pos / 60;
       const byte hours = mins / 60;
       const byte secs = pos % 60;
-      mMidi.sendPosition(hours, mins % 60, secs, 0);
+      mMidi.queuePosition(hours, mins % 60, secs, 0);
       mLedDisplay.setNumber(pos/10.0f);
       
       // Short update: accelerate encoder
-      if(timeDiff <= ACCEL_TIME_DELTA)
+      if( restartAccelTimeout() )
       {
         // increase rate 0.5 bpm after the other, with a limit of 10
         mEncoder.setStep( min(mEncoder.getStep() + 5, 100) );
       }
-      mLastUpdate = currentTime;
-    }
-
-    // No updates in a while: decelerate
-    if(timeDiff > ACCEL_TIME_DELTA)
-    {
-      mEncoder.setStep(1);
     }
   }
   
@@ -353,11 +730,31 @@ private:
     {
       mOldProgram = program;
 
-      mMidi.sendProgramChange( 1, program ); // Send on channel one
+      mMidi.queueProgramChange( 1, program ); // Send on channel one
       mLedDisplay.setNumber( (float)program );
     }
   }
   
+  void setStreamFromEncoder()
+  {
+    const unsigned int value = mEncoder.readValue();
+    
+    if( value != mControlStream.getTarget() )
+    {
+      mControlStream.setTarget(value);
+      // Controller scale on the display
+      mLedDisplay.setNumber( (float)(value >> 7) );
+      
+      // Short update: accelerate encoder, up to a full sweep in 32 steps
+      if( restartAccelTimeout() )
+      {
+        mEncoder.setStep( min(mEncoder.getStep() * 2, CONTROL_STREAM_STEP * 16) );
+      }
+    }
+    
+    mControlStream.update(micros());
+  }
+  
   bool areDifferent(const float f1, const float f2)
   {
     return abs(mBpm - mSavedBpm) >= 0.1f;
@@ -366,10 +763,7 @@ private:
 }; // end of class Application
 
 ////////////////////////// Main program
-Application gApp(120.0f /* defaultbpm */, 3 /* encoderpin */,
-                 5 /* btn1 */, 6 /* btn2 */, 7 /* btn3 */,
-                 8 /* btn4 */, A2 /* btn5 */, A3 /* btn6 */, A4 /* btn7 */, A0 /* selectorpin */, 
-                 4 /* leddata */, 10 /* ledlatch */, 9 /* ledclock */);
+Application<BoardConfig> gApp(120.0f /* defaultbpm */);
 void setup()
 {
   gApp.setup();
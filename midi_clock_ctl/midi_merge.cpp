@@ -0,0 +1,197 @@
+/*                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                      /*
+ MidiClockCtl : MIDI controller (Time Clock) with rotary encoder, 4 digit 7seg display and footswitches.
+ Copyright (C) 2013 Adrien Anselme
+
+ This file is part of MidiClockCtl.
+
+ MidiClockCtl is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 2 of the License, or
+ (at your option) any later version.
+
+ MidiClockCtl is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with MidiClockCtl.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include "midi_merge.h"
+#include "midi_proxy.h"
+#include "trace.h"
+#include "calibration.h"
+#include "mtc_chase.h"
+#include "control_stream.h"
+
+MidiMerge::MidiMerge()
+: mFilterClock(false), mCalibration(0), mMtcReader(0), mControlStream(0), mInSysex(false), mRunningStatus(0), mExpected(0), mCount(0)
+{
+}
+
+MidiMerge::~MidiMerge()
+{
+}
+
+void MidiMerge::setClockFilter(const bool filter)
+{
+  mFilterClock = filter;
+}
+
+void MidiMerge::setCalibration(ClockCalibration * calibration)
+{
+  mCalibration = calibration;
+}
+
+void MidiMerge::setMtcReader(MtcReader * reader)
+{
+  mMtcReader = reader;
+}
+
+void MidiMerge::setControlStream(ControlStream * stream)
+{
+  mControlStream = stream;
+}
+
+void MidiMerge::update()
+{
+  // Bytes are received in background by the serial interrupt,
+  // only handle a bounded amount here so the loop is never stalled
+  for( int i = 0; i < MIDI_MERGE_MAX_BYTES && Serial.available() > 0; ++i )
+  {
+    parse( Serial.read() );
+  }
+}
+
+void MidiMerge::parse(const byte data)
+{
+  if( data >= 0xF8 )
+  {
+    // Real time: allowed anywhere in the stream, doesn't affect parsing
+    if( data == 0xF8 && mCalibration )
+      mCalibration->onMidiClock();
+    const bool isTransport = (data == 0xF8) || (data >= 0xFA && data <= 0xFC);
+    if( !(mFilterClock && isTransport) )
+      MidiProxy::writeMessage(&data, 1);
+    return;
+  }
+  
+  if( data & 0x80 )
+  {
+    parseStatus(data);
+    return;
+  }
+  
+  // Data byte
+  if( mInSysex )
+  {
+    if( mCount < MIDI_MERGE_SYSEX_SIZE )
+      mMessage[mCount++] = data;
+    else
+      mCount = 0xFF; // Too long, will be dropped
+    return;
+  }
+  
+  if( mRunningStatus == 0 )
+    return; // Nothing to attach it to
+  
+  if( mCount == 0 )
+  {
+    // Running status
+    mMessage[0] = mRunningStatus;
+    mCount = 1;
+  }
+  mMessage[mCount++] = data;
+  
+  if( mCount > mExpected )
+  {
+    forwardMessage();
+    // System common messages don't support running status
+    if( mRunningStatus >= 0xF0 )
+      mRunningStatus = 0;
+  }
+}
+
+void MidiMerge::parseStatus(const byte status)
+{
+  if( status == 0xF7 )
+  {
+    if( mInSysex && mCount < MIDI_MERGE_SYSEX_SIZE )
+    {
+      mMessage[mCount++] = status;
+      forwardMessage();
+    }
+    mInSysex = false;
+    mCount = 0;
+    return;
+  }
+  
+  // Any other status ends an unterminated SysEx
+  mInSysex = (status == 0xF0);
+  mMessage[0] = status;
+  mCount = 1;
+  
+  if( mInSysex )
+  {
+    mRunningStatus = 0;
+    return;
+  }
+  
+  mRunningStatus = status;
+  mExpected = dataLength(status);
+  if( status >= 0xF0 && mExpected == 0 )
+  {
+    // Tune request (or undefined): nothing more to wait for
+    if( status == 0xF6 )
+      forwardMessage();
+    mRunningStatus = 0;
+  }
+}
+
+void MidiMerge::forwardMessage()
+{
+  if( mMessage[0] == 0xF1 && mCount == 2 && mCalibration )
+    mCalibration->onQuarterFrame(mMessage[1]);
+  
+  if( mMtcReader )
+  {
+    if( mMessage[0] == 0xF1 && mCount == 2 )
+      mMtcReader->onQuarterFrame(mMessage[1], micros());
+    // Full frame: F0 7F <device> 01 01 hr mn sc fr F7
+    else if( mMessage[0] == 0xF0 && mCount == 10 && mMessage[1] == 0x7F
+             && mMessage[3] == 0x01 && mMessage[4] == 0x01 )
+      mMtcReader->onFullFrame(mMessage[5], mMessage[6], mMessage[7], mMessage[8], micros());
+  }
+  
+  if( mControlStream && (mMessage[0] & 0xF0) == 0xB0 && mCount == 3 )
+    mControlStream->onThruController(mMessage[0], mMessage[1]);
+  
+  if( Trace::isDumpRequest(mMessage, mCount) )
+    Trace::requestDump();
+  else
+    MidiProxy::writeMessage(mMessage, mCount);
+  mCount = 0;
+}
+
+const byte MidiMerge::dataLength(const byte status)
+{
+  switch( status & 0xF0 )
+  {
+    case 0xC0: // Program Change
+    case 0xD0: // Channel AfterTouch
+      return 1;
+    case 0xF0:
+      switch( status )
+      {
+        case 0xF1: // MTC Quarter Frame
+        case 0xF3: // Song Select
+          return 1;
+        case 0xF2: // Song Position
+          return 2;
+        default:
+          return 0;
+      }
+    default:
+      return 2;
+  }
+}
@@ -0,0 +1,79 @@
+/*                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                      /*
+ MidiClockCtl : MIDI controller (Time Clock) with rotary encoder, 4 digit 7seg display and footswitches.
+ Copyright (C) 2013 Adrien Anselme
+
+ This file is part of MidiClockCtl.
+
+ MidiClockCtl is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 2 of the License, or
+ (at your option) any later version.
+
+ MidiClockCtl is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with MidiClockCtl.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef _MIDI_CLOCK_CTL_MIDI_MERGE_H_
+#define _MIDI_CLOCK_CTL_MIDI_MERGE_H_
+
+#include <Arduino.h>
+
+// Longer incoming SysEx messages are dropped
+#define MIDI_MERGE_SYSEX_SIZE 16
+// Max number of incoming bytes handled per update() call
+#define MIDI_MERGE_MAX_BYTES 16
+
+class ClockCalibration;
+class MtcReader;
+class ControlStream;
+
+/////////////////////////////////////
+// Forwards MIDI in to MIDI out, merged with what MidiProxy generates.
+// Incoming messages are only sent once complete, so local messages never
+// end up in the middle of them. Real time bytes are forwarded right away.
+class MidiMerge
+{
+public:
+  MidiMerge();
+  ~MidiMerge();
+
+  /// Drop incoming clock, Start, Stop and Continue
+  void setClockFilter(const bool filter);
+  
+  /// Incoming clock and MTC quarter frames are also given to calibration
+  void setCalibration(ClockCalibration * calibration);
+  
+  /// Incoming MTC (quarter frames and full frames) is also given to the reader,
+  /// timestamped when parsed
+  void setMtcReader(MtcReader * reader);
+  
+  /// Incoming controllers are shown to the stream, which may have to select
+  /// its NRPN again
+  void setControlStream(ControlStream * stream);
+  
+  // To be called in main loop function
+  void update();
+  
+private:
+  void parse(const byte data);
+  void parseStatus(const byte status);
+  void forwardMessage();
+  static const byte dataLength(const byte status);
+  
+private:
+  bool mFilterClock;
+  ClockCalibration * mCalibration;
+  MtcReader * mMtcReader;
+  ControlStream * mControlStream;
+  bool mInSysex;
+  byte mRunningStatus;
+  byte mExpected;
+  byte mCount;
+  byte mMessage[MIDI_MERGE_SYSEX_SIZE];
+};
+
+#endif
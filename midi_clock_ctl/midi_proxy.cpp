@@ -18,10 +18,24 @@
  along with MidiClockCtl.  If not, see <http://www.gnu.org/licenses/>.
 */
 #include "midi_proxy.h"
+#include "trace.h"
 
 // Allow 3 sec between taps at max (eq. to 20BPM)
 #define TAP_TIMEOUT_MS 3000
 
+// Beat flash duration, in clock ticks
+#define BEAT_FLASH_TICKS 2
+#define DOWNBEAT_FLASH_TICKS 6
+
+// Timeline mode: Timer1 free running with prescaler 64 (4 us, wraps every 262 ms)
+#define TIMELINE_PRESCALER 64
+#define TIMELINE_SELECT_BITS ((1 << CS11) | (1 << CS10))
+// A quarter frame (2 bytes on the wire, 640 us) due less than this before a
+// clock waits for the clock to go out first. In timeline counts.
+#define TIMELINE_MTC_GUARD_COUNTS (640 / 4)
+// MTC frame rate in timeline mode, must match mCurrentSmpteType
+#define TIMELINE_MTC_FPS 24
+
 ///////////////////////////////////// TapTempo
 TapTempo::TapTempo()
 {
@@ -94,6 +108,8 @@ float TapTempo::computeAverage() const
 
 ///////////////////////////////////// MidiProxy
 MidiProxy::MidiProxy()
+: mQueued(QueuedNone), mQueuedChannel(1), mQueuedProgram(0),
+  mQueuedInterval(0), mLastPositionTime(0), mLastProgramTime(0)
 {
 }
 
@@ -112,57 +128,483 @@ void MidiProxy::setup()
 
 void MidiProxy::doSendMidiClock()
 {
-  if( mEventTime != 0 && (millis() - mEventTime) >= 1 )
+  if( mPrerollTicksLeft > 0 )
   {
-    // Reset timer giving slaves time to prepare for playback
-    mEventTime = 0;
+    // Giving slaves time to prepare for playback
+    --mPrerollTicksLeft;
+    return;
   }
   
-  if( mNextEvent != InvalidType )
+  // Only transport commands go in the clock stream: anything else left in the
+  // mailbox (an MTC locate) is dropped rather than sent as a bare status byte
+  const byte nextEvent = mNextEvent;
+  if( nextEvent != InvalidType && nextEvent != Start && nextEvent != Stop && nextEvent != Continue )
+    mNextEvent = InvalidType;
+  
+  if( mNextEvent != InvalidType && (mSkipQuantize || isOnQuantizeBoundary()) )
   {
-    mEventTime = millis();
-    Serial.write(mNextEvent);
+    const MidiType event = static_cast<MidiType>(mNextEvent);
     mNextEvent = InvalidType;
+    mSkipQuantize = false;
+    writeFromTimer(event);
+    
+    if( event == Start )
+    {
+      // Next clock is the first one of the song
+      mBeatTick = 0;
+      mBeatInBar = 0;
+      mSongPosition = 0;
+    }
+    mTransportRunning = (event != Stop);
+    
+    const bool isStarting = (event == Start || event == Continue);
+    const bool hasPreroll = isStarting && startPreroll();
+    if( isStarting && mMode == SynchroClockMTC )
+      alignQuarterFrames(event == Start);
+    if( hasPreroll )
+      return;
   }  
   
-  if( mEventTime == 0 )
+  writeFromTimer(Clock);
+  updateBeatFlash();
+  advanceBeatCounter();
+}
+
+// Called right after a clock is sent, before advancing the beat counter
+void MidiProxy::updateBeatFlash()
+{
+  if( mBeatTick == 0 )
   {
-    Serial.write(Clock);
+    const bool isDownbeat = mTransportRunning && mBeatInBar == 0;
+    mBeatFlash = isDownbeat ? DownbeatFlash : BeatFlash;
+    mBeatFlashTicksLeft = isDownbeat ? DOWNBEAT_FLASH_TICKS : BEAT_FLASH_TICKS;
+    setBeatLedOn(true);
+    if( mTransportRunning && mBeatHandler )
+      mBeatHandler(isDownbeat);
+  }
+  else if( mBeatFlashTicksLeft > 0 && --mBeatFlashTicksLeft == 0 )
+  {
+    mBeatFlash = NoFlash;
+    setBeatLedOn(false);
   }
 }
 
-void MidiProxy::sendPlay()
+void MidiProxy::setBeatLedOn(const bool on)
+{
+  if( mBeatLedPort == 0 )
+    return;
+  
+  // Direct port access, digitalWrite() is too slow for the interrupt
+  if( on )
+    *mBeatLedPort |= mBeatLedMask;
+  else
+    *mBeatLedPort &= ~mBeatLedMask;
+}
+
+void MidiProxy::setBeatLed(const byte pin)
 {
+  pinMode(pin, OUTPUT);
+  digitalWrite(pin, LOW);
+  
   noInterrupts();
-  mNextEvent = Start;
+  mBeatLedMask = digitalPinToBitMask(pin);
+  mBeatLedPort = portOutputRegister(digitalPinToPort(pin));
   interrupts();
 }
 
-void MidiProxy::sendStop()
+void MidiProxy::setBeatHandler(void (*handler)(const bool downbeat))
 {
   noInterrupts();
-  mNextEvent = Stop;
+  mBeatHandler = handler;
   interrupts();
 }
 
+MidiProxy::BeatFlashState MidiProxy::getBeatFlash()
+{
+  return static_cast<BeatFlashState>(mBeatFlash);
+}
+
+// Delays the next clock by the pre-roll, counted in timer ticks.
+// Returns false if there is no pre-roll configured.
+bool MidiProxy::startPreroll()
+{
+  if( mPrerollSkipTicks == 0 && mPrerollRemainder == 0 )
+    return false;
+  
+  // Split for the previous tempo if the new one wasn't handed over yet
+  const unsigned int remainder = min(mPrerollRemainder, mPeriodCounts);
+  if( mMode == SynchroClockMTC )
+  {
+    // Free running timer, next clock already scheduled a period after this
+    // one: bring it to mPrerollRemainder counts after this one instead
+    unsigned int target = OCR1A - mPeriodCounts + remainder;
+    if( static_cast<int16_t>(target - TCNT1) < 2 )
+      target = TCNT1 + 2; // Already gone: as soon as possible
+    OCR1A = target;
+  }
+  else
+  {
+    // We are right after a compare match: shift the tick grid so the next one
+    // happens mPrerollRemainder counts after it. Staying below OCR1A as
+    // writing TCNT1 blocks the compare match on the next timer clock.
+    const unsigned int target = TCNT1 + (mPeriodCounts - remainder);
+    TCNT1 = (target < OCR1A) ? target : OCR1A - 1;
+  }
+  
+  mPrerollTicksLeft = mPrerollSkipTicks;
+  return true;
+}
+
+void MidiProxy::setStartPreroll(const unsigned long prerollUs)
+{
+  mPrerollUs = prerollUs;
+  updatePreroll();
+}
+
+// Splits the pre-roll in whole clock periods plus remaining timer counts,
+// so the interrupt has no division to do. Handed over through a mailbox
+// like the playhead: nothing to block, only plain variables are written
+void MidiProxy::updatePreroll()
+{
+  unsigned int skipTicks = 0;
+  unsigned int remainder = 0;
+  const unsigned long prerollCounts = mPrerollUs * (mCpuFrequency / 1000000.0f) / mPrescaler;
+  
+  if( prerollCounts > 0 && mPeriodCounts > 0 )
+  {
+    skipTicks = prerollCounts / mPeriodCounts;
+    remainder = prerollCounts % mPeriodCounts;
+    if( remainder == 0 )
+    {
+      remainder = mPeriodCounts;
+      --skipTicks;
+    }
+  }
+  
+  mPrerollRequest = false;
+  mRequestedPrerollSkipTicks = skipTicks;
+  mRequestedPrerollRemainder = remainder;
+  mPrerollRequest = true;
+}
+
+bool MidiProxy::isOnQuantizeBoundary()
+{
+  switch( mQuantize )
+  {
+    case QuantizeBeat:
+      return mBeatTick == 0;
+    case QuantizeBar:
+      return mBeatTick == 0 && mBeatInBar == 0;
+    default:
+      return true;
+  }
+}
+
+// Clocks keep running while stopped, so the beat grid is always defined
+void MidiProxy::advanceBeatCounter()
+{
+  ++mBeatTick;
+  // Song position only moves while playing, in 16th notes
+  if( mTransportRunning && (mBeatTick % (mMidiClockPpqn / 4)) == 0 )
+    ++mSongPosition;
+    
+  if( mBeatTick < mMidiClockPpqn )
+    return;
+    
+  mBeatTick = 0;
+  if( ++mBeatInBar >= mBeatsPerBar )
+    mBeatInBar = 0;
+}
+
+void MidiProxy::setQuantize(const Quantize quantize)
+{
+  mQuantize = quantize;
+}
+
+void MidiProxy::setMeter(const byte beatsPerBar)
+{
+  mBeatsPerBar = max(beatsPerBar, 1);
+}
+
+// Transport commands are a single byte mailbox, picked up by the next tick
+void MidiProxy::sendPlay()
+{
+  mNextEvent = Start;
+}
+
+void MidiProxy::sendStop()
+{
+  mNextEvent = Stop;
+}
+
+// Mailbox: the tick sets the event and its quantize flag together
+void MidiProxy::stopNow()
+{
+  mStopRequest = true;
+}
+
 void MidiProxy::sendContinue()
 {
-  noInterrupts();
+  // MTC restarts from the song position (which doesn't move while stopped)
+  if( mMode == SynchroClockMTC )
+    requestPlayheadFromSong(getSongPosition());
+    
   mNextEvent = Continue;
-  interrupts();
 }
 
 void MidiProxy::sendPosition(byte hours, byte minutes, byte seconds, byte frames)
 {
-  noInterrupts();
-  setPlayhead(hours, minutes, seconds, frames);
+  // Applied by the tick before it handles the event
+  requestPlayhead(hours, minutes, seconds, frames);
   mNextEvent = SongPosition;
-  interrupts();
 }
 
+// Main loop side of the playhead mailbox. The interrupt ignores it while the
+// flag is clear, so it never copies a half written position
+void MidiProxy::requestPlayhead(byte hours, byte minutes, byte seconds, byte frames)
+{
+  mPlayheadRequest = false;
+  mRequestedPlayhead.hours = hours;
+  mRequestedPlayhead.minutes = minutes;
+  mRequestedPlayhead.seconds = seconds;
+  mRequestedPlayhead.frames = frames;
+  mPlayheadRequest = true;
+}
+
+// Timer1 compare A: requests from the main loop first, then the mode handler.
+// The sequence number is odd while the interrupt changes shared state
+void MidiProxy::doTimerTick()
+{
+  ++mSequence;
+  if( mPrerollRequest )
+  {
+    mPrerollSkipTicks = mRequestedPrerollSkipTicks;
+    mPrerollRemainder = mRequestedPrerollRemainder;
+    mPrerollRequest = false;
+  }
+  if( mPlayheadRequest )
+  {
+    setPlayhead(mRequestedPlayhead.hours, mRequestedPlayhead.minutes,
+                mRequestedPlayhead.seconds, mRequestedPlayhead.frames);
+    // Quarter frames start over from the new position
+    mCurrentQFrame = 0;
+    mPlayheadRequest = false;
+  }
+  if( mStopRequest )
+  {
+    mNextEvent = Stop;
+    mSkipQuantize = true;
+    mStopRequest = false;
+  }
+  if( mResumeRequest )
+  {
+    applyResume();
+    mResumeRequest = false;
+  }
+  mTickHandler();
+  ++mSequence;
+}
+
+void MidiProxy::doTimerTickB()
+{
+  ++mSequence;
+  mTickHandlerB();
+  ++mSequence;
+}
+
+void MidiProxy::queuePosition(byte hours, byte minutes, byte seconds, byte frames)
+{
+  mQueuedPosition.hours = hours;
+  mQueuedPosition.minutes = minutes;
+  mQueuedPosition.seconds = seconds;
+  mQueuedPosition.frames = frames;
+  mQueued |= QueuedPosition;
+}
+
+void MidiProxy::queueProgramChange(byte channel, byte program)
+{
+  mQueuedChannel = channel;
+  mQueuedProgram = program;
+  mQueued |= QueuedProgramChange;
+}
+
+void MidiProxy::setMaxQueuedRate(const byte messagesPerSecond)
+{
+  mQueuedInterval = (messagesPerSecond > 0) ? 1000 / messagesPerSecond : 0;
+}
+
+void MidiProxy::update()
+{
+  if( mQueued == QueuedNone )
+    return;
+    
+  const unsigned long currentTime = millis();
+  
+  // A position is a locate of the MTC page: dropped if the selector left it
+  if( (mQueued & QueuedPosition) && getMode() != SynchroMTC )
+    mQueued &= ~QueuedPosition;
+  
+  if( (mQueued & QueuedPosition) && canSendQueued(currentTime, mLastPositionTime) )
+  {
+    mQueued &= ~QueuedPosition;
+    sendPosition(mQueuedPosition.hours, mQueuedPosition.minutes,
+                 mQueuedPosition.seconds, mQueuedPosition.frames);
+  }
+  
+  if( (mQueued & QueuedProgramChange) && canSendQueued(currentTime, mLastProgramTime) )
+  {
+    mQueued &= ~QueuedProgramChange;
+    sendProgramChange(mQueuedChannel, mQueuedProgram);
+  }
+}
+
+bool MidiProxy::canSendQueued(const unsigned long currentTime, unsigned long & lastSendTime) const
+{
+  if( (currentTime - lastSendTime) < mQueuedInterval )
+    return false;
+    
+  lastSendTime = currentTime;
+  return true;
+}
+
+// Readers of state changed by the timer interrupt don't stop it: they read
+// again if a tick happened in the meantime (sequence number changed)
 bool MidiProxy::isPlaying() const
 {
-  return (mNextEvent == Continue) || (mNextEvent == Start);
+  byte sequence;
+  byte nextEvent;
+  bool running;
+  bool stopRequest;
+  do
+  {
+    sequence = mSequence;
+    nextEvent = mNextEvent;
+    running = mTransportRunning;
+    stopRequest = mStopRequest;
+  } while( (sequence & 1) || sequence != mSequence );
+  
+  if( stopRequest )
+    return false;
+  if( nextEvent == Continue || nextEvent == Start )
+    return true;
+  if( nextEvent == Stop )
+    return false;
+  // Clock mode: Start / Continue already sent
+  return hasClock() && running;
+}
+
+bool MidiProxy::isStopped() const
+{
+  byte sequence;
+  byte nextEvent;
+  bool running;
+  bool pending;
+  do
+  {
+    sequence = mSequence;
+    nextEvent = mNextEvent;
+    running = mTransportRunning;
+    pending = mStopRequest || mResumeRequest;
+  } while( (sequence & 1) || sequence != mSequence );
+  
+  return !running && !pending && nextEvent == InvalidType;
+}
+
+unsigned int MidiProxy::getSongPosition()
+{
+  byte sequence;
+  unsigned int position;
+  do
+  {
+    sequence = mSequence;
+    position = mSongPosition;
+  } while( (sequence & 1) || sequence != mSequence );
+  return position;
+}
+
+float MidiProxy::getSongClocks()
+{
+  byte sequence;
+  unsigned long sent;
+  uint16_t countsLeft;
+  unsigned int period;
+  do
+  {
+    sequence = mSequence;
+    sent = mSongPosition * 6UL + mBeatTick % (mMidiClockPpqn / 4);
+    // Counts to the next clock (same in CTC and timeline modes). A tick in
+    // the middle of these 16 bit reads changes the sequence: read again
+    countsLeft = OCR1A - TCNT1;
+    period = mPeriodCounts;
+  } while( (sequence & 1) || sequence != mSequence );
+  return sent - min(countsLeft, period) / static_cast<float>(period);
+}
+
+void MidiProxy::getPosition(byte & hours, byte & minutes, byte & seconds, byte & frames)
+{
+  byte sequence;
+  do
+  {
+    sequence = mSequence;
+    hours = mPlayhead.hours;
+    minutes = mPlayhead.minutes;
+    seconds = mPlayhead.seconds;
+    frames = mPlayhead.frames;
+  } while( (sequence & 1) || sequence != mSequence );
+}
+
+bool MidiProxy::resumeClock(const unsigned int songPosition)
+{
+  // A pending Stop would be overwritten in the mailbox by the Continue
+  if( !isStopped() )
+    return false;
+  
+  byte message[3];
+  message[0] = SongPosition;
+  message[1] = songPosition & 0x7F;
+  message[2] = (songPosition >> 7) & 0x7F;
+  // Before the Continue is queued, so it can't come first
+  writeMessage(message, 3);
+  
+  if( mMode == SynchroClockMTC )
+    requestPlayheadFromSong(songPosition);
+  
+  // Mailbox: position and Continue applied together by the next tick
+  mResumeRequest = false;
+  mResumePosition = songPosition;
+  mResumeRequest = true;
+  tickNow();
+  return true;
+}
+
+// From the timer interrupt
+void MidiProxy::applyResume()
+{
+  mSongPosition = mResumePosition;
+  // Beat grid from the position: 4 sixteenths per beat
+  mBeatTick = (mResumePosition % 4) * (mMidiClockPpqn / 4);
+  mBeatInBar = (mResumePosition / 4) % mBeatsPerBar;
+  mNextEvent = Continue;
+  // Position is already where the song must go on: not waiting for a boundary
+  mSkipQuantize = true;
+}
+
+void MidiProxy::resumeMTC(byte hours, byte minutes, byte seconds, byte frames)
+{
+  requestPlayhead(hours, minutes, seconds, frames);
+  mNextEvent = Continue;
+  tickNow();
+}
+
+// Next timer interrupt as soon as possible instead of a whole period
+// later. Shortens the current period: only for restarting output.
+// 16 bit timer registers share a temporary byte with the interrupt's
+// accesses: blocked for the few cycles of the access only
+void MidiProxy::tickNow()
+{
+  noInterrupts();
+  TCNT1 = OCR1A - 1;
+  interrupts();
 }
 
 void MidiProxy::doSendMTC()
@@ -181,25 +623,113 @@ void MidiProxy::doSendMTC()
       mNextEvent = Continue;
     }
       
-    sendMTCQuarterFrame(mCurrentQFrame);
-    mCurrentQFrame = (mCurrentQFrame + 1) % 8;
-    
-    if(mCurrentQFrame == 0)
-      updatePlayhead();
+    sendNextQuarterFrame();
   }
 }
 
-void MidiProxy::setMode(MidiProxy::MidiSynchro newMode)
+void MidiProxy::sendNextQuarterFrame()
+{
+  sendMTCQuarterFrame(mCurrentQFrame);
+  mCurrentQFrame = (mCurrentQFrame + 1) % 8;
+  
+  if(mCurrentQFrame == 0)
+    updatePlayhead();
+}
+
+// Timer1 compare A in timeline mode
+void MidiProxy::doSendTimelineClock()
 {
-  if( mMode != newMode )
+  // Next deadline first, from the previous one: no drift whatever is sent below
+  const unsigned int fraction = mClockFraction + mClockPeriodFraction;
+  OCR1A += mPeriodCounts + (fraction >> 8);
+  mClockFraction = fraction;
+  
+  doSendMidiClock();
+  
+  if( mQuarterFramePending )
   {
-    mMode = newMode;
+    mQuarterFramePending = false;
+    if( mTransportRunning )
+      sendNextQuarterFrame();
+  }
+}
+
+// Timer1 compare B in timeline mode
+void MidiProxy::doSendTimelineMTC()
+{
+  const unsigned int fraction = mQuarterFrameFraction + mQuarterFramePeriodFraction;
+  OCR1B += mQuarterFramePeriodCounts + (fraction >> 8);
+  mQuarterFrameFraction = fraction;
   
-    if(mMode == MidiProxy::SynchroMTC)
-    {
-      setTimer(24 * 4);
-    }
+  // Time code only runs with the song
+  if( !mTransportRunning )
+    return;
+  
+  // Clock jitter matters more: if one is about to go, let it through first.
+  // Signed: with compare A already pending, OCR1A is at or behind TCNT1.
+  // Clock periods fit (31250 counts at 20 BPM, the slowest)
+  if( static_cast<int16_t>(OCR1A - TCNT1) < TIMELINE_MTC_GUARD_COUNTS )
+  {
+    mQuarterFramePending = true;
+    return;
   }
+  sendNextQuarterFrame();
+}
+
+// Start or Continue just sent: first quarter frame along with the first clock
+void MidiProxy::alignQuarterFrames(const bool fromStart)
+{
+  if( fromStart )
+    resetPlayhead();
+  mCurrentQFrame = 0;
+  mQuarterFramePending = false;
+  OCR1B = OCR1A;
+  mQuarterFrameFraction = mClockFraction;
+}
+
+// Song position to time at the current tempo, for MTC to follow it
+void MidiProxy::requestPlayheadFromSong(const unsigned int songPosition)
+{
+  const float seconds = songPosition * 15.0f / mBpm; // 4 sixteenths per beat
+  const unsigned long totalFrames = seconds * TIMELINE_MTC_FPS;
+  // Quarter frames carry the frame count in steps of 2
+  const unsigned long frames = totalFrames & ~1UL;
+  const unsigned long totalSeconds = frames / TIMELINE_MTC_FPS;
+  
+  requestPlayhead(totalSeconds / 3600, (totalSeconds / 60) % 60, totalSeconds % 60, frames % TIMELINE_MTC_FPS);
+}
+
+// Returns true if the mode changed
+bool MidiProxy::setMode(const MidiProxy::MidiSynchro newMode, const TickHandler handler)
+{
+  if( mMode == newMode )
+    return false;
+    
+  noInterrupts();
+  mMode = newMode;
+  mTickHandler = handler;
+  mTickHandlerB = doNothing;
+  // Clock interrupt won't be there to switch it off
+  mBeatFlash = NoFlash;
+  setBeatLedOn(false);
+  interrupts();
+  return true;
+}
+
+void MidiProxy::doNothing()
+{
+}
+
+void MidiProxy::setModeClockMTC()
+{
+  if( !setMode(SynchroClockMTC, doSendTimelineClock) )
+    return;
+  
+  noInterrupts();
+  mTickHandlerB = doSendTimelineMTC;
+  interrupts();
+  if( mTimerFrequency > 0.0f )
+    setTimer(mTimerFrequency);
 }
 
 MidiProxy::MidiSynchro MidiProxy::getMode()
@@ -207,12 +737,19 @@ MidiProxy::MidiSynchro MidiProxy::getMode()
   return mMode;
 }
 
-void MidiProxy::sendMTCQuarterFrame(int index)
+bool MidiProxy::hasClock()
+{
+  return mMode == SynchroClock || mMode == SynchroClockMTC;
+}
+
+void MidiProxy::sendMTCQuarterFrame(byte index)
 {
-  Serial.write(TimeCodeQuarterFrame);
+  writeFromTimer(TimeCodeQuarterFrame);
   
+  // Quarter frame types are simply the index in the high nibble
+  const byte type = index << 4;
   byte MTCData = 0;
-  switch(mMTCQuarterFrameTypes[index])
+  switch(type)
   {
     case FramesLow:
       MTCData = mPlayhead.frames & 0x0f;
@@ -239,7 +776,7 @@ void MidiProxy::sendMTCQuarterFrame(int index)
       MTCData = (mPlayhead.hours & 0xf0) >> 4 | mCurrentSmpteType;
       break;
   }
-  Serial.write( mMTCQuarterFrameTypes[index] | MTCData );
+  writeFromTimer( type | MTCData );
 }
 
 void MidiProxy::sendMTCFullFrame()
@@ -247,20 +784,69 @@ void MidiProxy::sendMTCFullFrame()
   /// F0 7F cc 01 01 hr mn sc fr F7
   // cc -> channel (0x7f to broadcast)
   // hr -> hour, mn -> minutes, sc -> seconds, fr -> frames
-  static byte header[5] = { 0xf0, 0x7f, 0x7f, 0x01, 0x01 };
-  Serial.write(header, 5);
-  Serial.write(mPlayhead.hours);
-  Serial.write(mPlayhead.minutes);
-  Serial.write(mPlayhead.seconds);
-  Serial.write(mPlayhead.frames);
-  Serial.write(0xf7);
+  static const byte header[5] PROGMEM = { 0xf0, 0x7f, 0x7f, 0x01, 0x01 };
+  for( byte i = 0; i < 5; ++i )
+    writeFromTimer(pgm_read_byte(&header[i]));
+  writeFromTimer(mPlayhead.hours);
+  writeFromTimer(mPlayhead.minutes);
+  writeFromTimer(mPlayhead.seconds);
+  writeFromTimer(mPlayhead.frames);
+  writeFromTimer(0xf7);
+}
+
+// Timer interrupt also writes to Serial: HardwareSerial is not reentrant,
+// and its bytes must not split ours. While we write, the interrupt puts its
+// bytes in a ring instead, sent right after our message. The interrupt is
+// never held back.
+void MidiProxy::writeMessage(const byte * data, const byte length)
+{
+  mMainWriting = true;
+  Serial.write(data, length);
+  
+  for( ;; )
+  {
+    while( mTimerRingTail != mTimerRingHead )
+    {
+      Serial.write(mTimerRing[mTimerRingTail]);
+      mTimerRingTail = (mTimerRingTail + 1) & (MIDI_TIMER_RING_SIZE - 1);
+    }
+    mMainWriting = false;
+    // A byte may have come in just before the flag was cleared
+    if( mTimerRingTail == mTimerRingHead )
+      break;
+    mMainWriting = true;
+  }
+  
+  for( byte i = 0; i < length; ++i )
+    Trace::recordMain(Trace::OutputByte, data[i]);
+}
+
+// Output from the timer interrupt
+void MidiProxy::writeFromTimer(const byte data)
+{
+  // Behind bytes already in the ring, to keep the order
+  if( mMainWriting || mTimerRingTail != mTimerRingHead )
+  {
+    const byte next = (mTimerRingHead + 1) & (MIDI_TIMER_RING_SIZE - 1);
+    // Can't be full: a tick writes a few bytes, drained right after a message
+    if( next != mTimerRingTail )
+    {
+      mTimerRing[mTimerRingHead] = data;
+      mTimerRingHead = next;
+    }
+  }
+  else
+    Serial.write(data);
+  Trace::recordIsr(Trace::OutputByte, data);
 }
 
 void MidiProxy::sendControlChange(byte channel, byte cc, byte value)
 {
-  Serial.write(ControlChange | ((channel - 1) & 0x0F));
-  Serial.write(cc & 0x7F);
-  Serial.write(value & 0x7F);
+  byte message[3];
+  message[0] = ControlChange | ((channel - 1) & 0x0F);
+  message[1] = cc & 0x7F;
+  message[2] = value & 0x7F;
+  writeMessage(message, 3);
 }
 
 void MidiProxy::sendDefaultControlChangeOn(byte cc)
@@ -270,8 +856,10 @@ void MidiProxy::sendDefaultControlChangeOn(byte cc)
 
 void MidiProxy::sendProgramChange(byte channel, byte value)
 {
-  Serial.write( ProgramChange | ((channel - 1) & 0x0f) );
-  Serial.write(value & 0x7F);
+  byte message[2];
+  message[0] = ProgramChange | ((channel - 1) & 0x0f);
+  message[1] = value & 0x7F;
+  writeMessage(message, 2);
 }
 
 // To be called every two frames (so once a complete cycle of quarter frame messages have passed)
@@ -305,7 +893,8 @@ void MidiProxy::setPlayhead(byte hours, byte minutes, byte seconds, byte frames)
 
 void MidiProxy::setBpm(const float iBpm)
 {
-  if( getMode() == SynchroClock )
+  mBpm = iBpm;
+  if( hasClock() )
   {
     const double midiClockPerSec = mMidiClockPpqn * iBpm / 60;
     setTimer(midiClockPerSec);
@@ -314,21 +903,39 @@ void MidiProxy::setBpm(const float iBpm)
 
 const float MidiProxy::tapTempo()
 {
-  if( getMode() == SynchroClock )
+  if( hasClock() )
   {
     return mTapTempo.tap();
   }
   return 0.0f;
 }
 
+void MidiProxy::setClockTrim(const long ppm)
+{
+  mCpuFrequency = 16000000 + ppm * 16;
+  if( mTimerFrequency > 0.0f )
+    setTimer(mTimerFrequency);
+}
+
 void MidiProxy::setTimer(const double frequency)
 {
-  if(frequency > 244.16f) // First value with cmp_match < 65536 (thus allowing to decrease prescaler for higher precision)
+  mTimerFrequency = frequency;
+  if( mMode == SynchroClockMTC )
+  {
+    setTimelineTimer(frequency);
+    return;
+  }
+  mTimelineRunning = false;
+  
+  // Smallest prescaler with cmp_match < 65536, for higher precision
+  // (thresholds depend on the trimmed CPU clock)
+  const float countsPerPeriod = mCpuFrequency / frequency;
+  if(countsPerPeriod <= 65536.0f)
   {
     mPrescaler = 1;
     mSelectBits = (1 << CS10);
   }
-  else if(frequency > 30.52f) // First value with cmp_match < 65536
+  else if(countsPerPeriod <= 8 * 65536.0f)
   {
     mPrescaler = 8;
     mSelectBits = (1 << CS11);
@@ -338,9 +945,21 @@ void MidiProxy::setTimer(const double frequency)
     mPrescaler = 64;
     mSelectBits = (1 << CS11) | (1 << CS10);
   }
-  const uint16_t cmp_match = 16000000 / (frequency * mPrescaler) - 1 + 0.5f; // (must be < 65536)
+  const uint16_t cmp_match = countsPerPeriod / mPrescaler - 1 + 0.5f; // (must be < 65536)
   
   noInterrupts();
+  if( TCCR1B == ((1 << WGM12) | mSelectBits) && (TIMSK1 & (1 << OCIE1A)) )
+  {
+    // Already running: only change the period, so the current one just gets
+    // shorter or longer and the clock keeps its phase (tempo follows smoothly)
+    OCR1A = cmp_match;
+    if( TCNT1 >= cmp_match )
+      TCNT1 = cmp_match - 1;
+    interrupts();
+    mPeriodCounts = cmp_match + 1;
+    updatePreroll();
+    return;
+  }
   TCCR1A = 0;// set entire TCCR1A register to 0
   TCCR1B = 0;// same for TCCR1B
   TCNT1  = 0;//initialize counter value to 0
@@ -350,29 +969,107 @@ void MidiProxy::setTimer(const double frequency)
   TCCR1B |= (1 << WGM12);
   // Set CS10 for prescaler 1, CS11 for prescaler 8, and both for prescaler 64
   TCCR1B |= mSelectBits;
-  // enable timer compare interrupt
-  TIMSK1 |= (1 << OCIE1A);
+  // enable timer compare interrupt (only A)
+  TIMSK1 = (TIMSK1 & ~(1 << OCIE1B)) | (1 << OCIE1A);
   interrupts();
+  
+  mPeriodCounts = cmp_match + 1;
+  updatePreroll();
+}
+
+// Timeline mode: only the clock period changes with the tempo,
+// the next clock stays where it was scheduled
+void MidiProxy::setTimelineTimer(const double clockFrequency)
+{
+  const float countsPerSecond = mCpuFrequency / static_cast<float>(TIMELINE_PRESCALER);
+  const unsigned long clockPeriod = countsPerSecond * 256.0f / clockFrequency + 0.5f;
+  const unsigned long quarterFramePeriod = countsPerSecond * 256.0f / (TIMELINE_MTC_FPS * 4) + 0.5f;
+  
+  noInterrupts();
+  mPrescaler = TIMELINE_PRESCALER;
+  mPeriodCounts = clockPeriod >> 8;
+  mClockPeriodFraction = clockPeriod & 0xFF;
+  mQuarterFramePeriodCounts = quarterFramePeriod >> 8;
+  mQuarterFramePeriodFraction = quarterFramePeriod & 0xFF;
+  
+  if( !mTimelineRunning )
+  {
+    // Normal mode (free running), both compare interrupts
+    TCCR1A = 0;
+    TCCR1B = TIMELINE_SELECT_BITS;
+    OCR1A = TCNT1 + mPeriodCounts;
+    OCR1B = TCNT1 + mQuarterFramePeriodCounts;
+    mClockFraction = 0;
+    mQuarterFrameFraction = 0;
+    mQuarterFramePending = false;
+    TIFR1 = (1 << OCF1A) | (1 << OCF1B);
+    TIMSK1 |= (1 << OCIE1A) | (1 << OCIE1B);
+    mTimelineRunning = true;
+  }
+  interrupts();
+  
+  updatePreroll();
 }
 
 ISR(TIMER1_COMPA_vect) //timer1 interrupt
 {
-  if( MidiProxy::getMode() == MidiProxy::SynchroMTC )
-    MidiProxy::doSendMTC();
-  else if( MidiProxy::getMode() == MidiProxy::SynchroClock )
-    MidiProxy::doSendMidiClock();
+  MidiProxy::doTimerTick();
+}
+
+ISR(TIMER1_COMPB_vect)
+{
+  MidiProxy::doTimerTickB();
 }
 
+unsigned long MidiProxy::mCpuFrequency = 16000000;
+float MidiProxy::mTimerFrequency = 0.0f;
 int MidiProxy::mPrescaler = 0;
 unsigned char MidiProxy::mSelectBits = 0;
+unsigned int MidiProxy::mPeriodCounts = 0;
 
 const int MidiProxy::mMidiClockPpqn = 24;
-volatile unsigned long MidiProxy::mEventTime = 0;
-volatile MidiProxy::MidiType MidiProxy::mNextEvent = InvalidType;
+unsigned long MidiProxy::mPrerollUs = 0;
+volatile unsigned int MidiProxy::mPrerollSkipTicks = 0;
+volatile unsigned int MidiProxy::mPrerollRemainder = 0;
+volatile unsigned int MidiProxy::mPrerollTicksLeft = 0;
+volatile byte MidiProxy::mNextEvent = InvalidType;
+volatile bool MidiProxy::mSkipQuantize = false;
+volatile byte MidiProxy::mQuantize = MidiProxy::QuantizeOff;
+volatile byte MidiProxy::mBeatsPerBar = 4;
+volatile byte MidiProxy::mBeatTick = 0;
+volatile byte MidiProxy::mBeatInBar = 0;
+volatile bool MidiProxy::mTransportRunning = false;
+volatile unsigned int MidiProxy::mSongPosition = 0;
+float MidiProxy::mBpm = 120.0f;
+bool MidiProxy::mTimelineRunning = false;
+volatile byte MidiProxy::mClockPeriodFraction = 0;
+volatile byte MidiProxy::mClockFraction = 0;
+unsigned int MidiProxy::mQuarterFramePeriodCounts = 0;
+byte MidiProxy::mQuarterFramePeriodFraction = 0;
+volatile byte MidiProxy::mQuarterFrameFraction = 0;
+volatile bool MidiProxy::mQuarterFramePending = false;
+volatile byte MidiProxy::mBeatFlash = MidiProxy::NoFlash;
+volatile byte MidiProxy::mBeatFlashTicksLeft = 0;
+volatile uint8_t * MidiProxy::mBeatLedPort = 0;
+byte MidiProxy::mBeatLedMask = 0;
+void (* volatile MidiProxy::mBeatHandler)(const bool downbeat) = 0;
 
 const MidiProxy::SmpteMask MidiProxy::mCurrentSmpteType = Frames24;
 volatile MidiProxy::Playhead MidiProxy::mPlayhead = MidiProxy::Playhead();
-volatile int MidiProxy::mCurrentQFrame = 0;
-const MidiProxy::MTCQuarterFrameType MidiProxy::mMTCQuarterFrameTypes[8] = { FramesLow, FramesHigh, SecondsLow, SecondsHigh,
-                                                                             MinutesLow, MinutesHigh, HoursLow, HoursHighAndSmpte };
+volatile byte MidiProxy::mCurrentQFrame = 0;
+volatile MidiProxy::Playhead MidiProxy::mRequestedPlayhead = MidiProxy::Playhead();
+volatile bool MidiProxy::mPlayheadRequest = false;
+volatile unsigned int MidiProxy::mResumePosition = 0;
+volatile bool MidiProxy::mResumeRequest = false;
+volatile unsigned int MidiProxy::mRequestedPrerollSkipTicks = 0;
+volatile unsigned int MidiProxy::mRequestedPrerollRemainder = 0;
+volatile bool MidiProxy::mPrerollRequest = false;
+volatile bool MidiProxy::mStopRequest = false;
+volatile byte MidiProxy::mSequence = 0;
+volatile bool MidiProxy::mMainWriting = false;
+byte MidiProxy::mTimerRing[MIDI_TIMER_RING_SIZE];
+volatile byte MidiProxy::mTimerRingHead = 0;
+volatile byte MidiProxy::mTimerRingTail = 0;
 MidiProxy::MidiSynchro MidiProxy::mMode = MidiProxy::SynchroNone;
+volatile MidiProxy::TickHandler MidiProxy::mTickHandler = MidiProxy::doNothing;
+volatile MidiProxy::TickHandler MidiProxy::mTickHandlerB = MidiProxy::doNothing;
@@ -26,6 +26,10 @@
 // to change BPM, just that smoothing operates on this value.
 #define TAP_NUM_READINGS 5
 
+// Bytes the timer interrupt can write while the main loop is writing a
+// message, power of 2
+#define MIDI_TIMER_RING_SIZE 16
+
 /////////////////////////////////////
 class TapTempo
 {
@@ -54,42 +58,25 @@ public:
   {
     SynchroNone = 0,
     SynchroClock,
-    SynchroMTC
+    SynchroMTC,
+    SynchroClockMTC   ///< Clock and MTC from the same timeline, MTC following the song position
   };
   
-  MidiProxy();
-  ~MidiProxy();
-
-  // To be called on main program setup
-  void setup();
-
-  // Only active in Midi Clock mode
-  void setBpm(const float iBpm);
-  const float tapTempo();
-  //
-
-  static void setMode(MidiSynchro newMode);
-  static MidiSynchro getMode();
-  
-  // Only active in clock and MTC :
-  void sendPlay();
-  void sendStop();
-  void sendContinue();
-  bool isPlaying() const;
-  //
-  
-  // Only active in MTC :
-  void sendPosition(byte hours, byte minutes, byte seconds, byte frames);
-  //
+  enum BeatFlashState
+  {
+    NoFlash = 0,
+    BeatFlash,
+    DownbeatFlash
+  };
   
-  /** Sends a CC on channel 1, with a value of 127 */
-  void sendDefaultControlChangeOn(byte cc);
-  void sendProgramChange(byte channel, byte program);
+  enum Quantize
+  {
+    QuantizeOff = 0,
+    QuantizeBeat,
+    QuantizeBar
+  };
   
-  static void doSendMidiClock();
-  static void doSendMTC();
-    
-private:
+  /// Message definitions, also used by the host tools (e.g. midi_analyze)
   enum MidiType 
   {
     InvalidType           = 0x00,    ///< For notifying errors
@@ -133,6 +120,113 @@ private:
     Frames30              = B0110,
   };
   
+  MidiProxy();
+  ~MidiProxy();
+
+  // To be called on main program setup
+  void setup();
+  
+  // To be called in main loop function
+  void update();
+
+  // Only active in Midi Clock mode
+  void setBpm(const float iBpm);
+  const float tapTempo();
+  
+  /// Start, Stop and Continue are held until the next beat or bar boundary
+  /// of the outgoing clock instead of being sent on the next tick
+  void setQuantize(const Quantize quantize);
+  void setMeter(const byte beatsPerBar);
+  
+  /// Delay between Start/Continue and the first following clock, so slaves
+  /// have time to prepare for playback. 0 sends the clock right away
+  void setStartPreroll(const unsigned long prerollUs);
+  
+  /// LED flashed by the clock interrupt on every beat, longer on the
+  /// downbeat while playing. Switched right after sending the clock.
+  void setBeatLed(const byte pin);
+  /// Called by the clock interrupt on every beat while playing, right after
+  /// the clock is written (e.g. Click::trigger). Must be short
+  void setBeatHandler(void (*handler)(const bool downbeat));
+  
+  /// Error of the CPU clock in ppm (positive when fast, see ClockCalibration),
+  /// compensated in all timer periods
+  static void setClockTrim(const long ppm);
+  /// NoFlash when off, BeatFlash or DownbeatFlash while a flash is going on
+  static BeatFlashState getBeatFlash();
+  //
+
+  /// Each mode installs its own timer interrupt handler: code of the
+  /// modes never set is left out of the firmware
+  static void setModeNone() { setMode(SynchroNone, doNothing); }
+  static void setModeClock() { setMode(SynchroClock, doSendMidiClock); }
+  static void setModeMTC() { if( setMode(SynchroMTC, doSendMTC) ) setTimer(24 * 4); }
+  static void setModeClockMTC();
+  static MidiSynchro getMode();
+  /// True in the modes sending MIDI clock
+  static bool hasClock();
+  
+  // Only active in clock and MTC :
+  void sendPlay();
+  void sendStop();
+  void sendContinue();
+  bool isPlaying() const;
+  /// Stop on the next tick, not quantized: for following an external transport
+  void stopNow();
+  /// Stop sent and no transport command pending
+  bool isStopped() const;
+  //
+  
+  // Only active in MTC :
+  void sendPosition(byte hours, byte minutes, byte seconds, byte frames);
+  //
+  
+  /// Current song position in MIDI beats (16th notes) since Start, clock mode
+  static unsigned int getSongPosition();
+  /// Song position now in clocks, while playing: next clock to send,
+  /// minus the part of its period still to go
+  static float getSongClocks();
+  /// Current MTC playhead
+  static void getPosition(byte & hours, byte & minutes, byte & seconds, byte & frames);
+  
+  /// Restart playback from a saved position, e.g. after a power loss.
+  /// Clock: Song Position Pointer, then Continue on the next tick.
+  /// MTC: quarter frames from the position. Mode must be set first.
+  /// Output restarts right away (not quantized): meant for boot or
+  /// for starting in sync with something else. Returns false, doing
+  /// nothing, unless isStopped(): slaves must not move while running
+  bool resumeClock(const unsigned int songPosition);
+  void resumeMTC(byte hours, byte minutes, byte seconds, byte frames);
+  
+  /** Sends a CC on channel 1, with a value of 127 */
+  void sendDefaultControlChangeOn(byte cc);
+  void sendProgramChange(byte channel, byte program);
+  
+  /// Encoder driven messages: only the latest value of each kind is kept, and sent
+  /// from update() no more than messagesPerSecond times. The last one always goes out.
+  void queuePosition(byte hours, byte minutes, byte seconds, byte frames);
+  void queueProgramChange(byte channel, byte program);
+  void setMaxQueuedRate(const byte messagesPerSecond);
+  
+  /// Writes a complete message, without letting the timer interrupt
+  /// insert its own bytes in the middle. For use outside of interrupts
+  static void writeMessage(const byte * data, const byte length);
+  
+  /// Timer interrupt entry points: run the current mode handlers
+  static void doTimerTick();
+  static void doTimerTickB();
+  
+  static void doSendMidiClock();
+  static void doSendMTC();
+  static void doSendTimelineClock();
+  static void doSendTimelineMTC();
+    
+private:
+  typedef void (*TickHandler)();
+  
+  static bool setMode(const MidiSynchro newMode, const TickHandler handler);
+  static void doNothing();
+  
   struct Playhead
   {
     byte frames;
@@ -142,30 +236,108 @@ private:
   };
   
 private:
-  static void sendMTCQuarterFrame(int index);
+  static void writeFromTimer(const byte data);
+  static void sendMTCQuarterFrame(byte index);
+  static void sendNextQuarterFrame();
+  static void alignQuarterFrames(const bool fromStart);
+  static void setTimelineTimer(const double clockFrequency);
+  static void requestPlayheadFromSong(const unsigned int songPosition);
+  static void requestPlayhead(byte hours, byte minutes, byte seconds, byte frames);
+  static void applyResume();
   static void sendMTCFullFrame();
   static void updatePlayhead();
   static void resetPlayhead();
   static void setPlayhead(byte hours, byte minutes, byte seconds, byte frames);
   static void setTimer(const double frequency);
+  static void tickNow();
+  static void updatePreroll();
+  static bool startPreroll();
+  static bool isOnQuantizeBoundary();
+  static void advanceBeatCounter();
+  static void updateBeatFlash();
+  static void setBeatLedOn(const bool on);
   void sendControlChange(byte channel, byte cc, byte value);
+  bool canSendQueued(const unsigned long currentTime, unsigned long & lastSendTime) const;
   
 private:
   static MidiSynchro mMode;
+  static volatile TickHandler mTickHandler;
+  static volatile TickHandler mTickHandlerB;  // Timer1 compare B, used by the timeline only
+  
+  // Rate limited messages
+  enum QueuedMessage
+  {
+    QueuedNone            = 0x00,
+    QueuedPosition        = 0x01,
+    QueuedProgramChange   = 0x02
+  };
+  byte mQueued;
+  Playhead mQueuedPosition;
+  byte mQueuedChannel;
+  byte mQueuedProgram;
+  unsigned int mQueuedInterval;
+  unsigned long mLastPositionTime;
+  unsigned long mLastProgramTime;
   
   // Midi Clock Stuff
   TapTempo mTapTempo;
   static const int mMidiClockPpqn;
-  static volatile unsigned long mEventTime;
-  static volatile MidiType mNextEvent;
+  static unsigned long mPrerollUs;
+  static volatile unsigned int mPrerollSkipTicks;  // Whole clock periods of pre-roll...
+  static volatile unsigned int mPrerollRemainder;  // ...plus this many timer counts (1 to period)
+  static volatile unsigned int mPrerollTicksLeft;
+  static volatile byte mNextEvent;     // MidiType, mailbox for transport commands
+  static volatile bool mSkipQuantize;  // mNextEvent goes out on the next tick
+  static unsigned long mCpuFrequency;  // Actual CPU clock, Hz
+  static float mTimerFrequency;
   static int mPrescaler;
+  static unsigned int mPeriodCounts;
   static unsigned char mSelectBits;
+  static volatile byte mQuantize;
+  static volatile byte mBeatsPerBar;
+  static volatile byte mBeatTick;  // Index of the next clock within the current beat
+  static volatile byte mBeatInBar; // Index of the current beat within the bar
+  static volatile bool mTransportRunning;
+  static volatile unsigned int mSongPosition; // 16th notes since Start
+  static float mBpm;
+  
+  // Timeline (clock and MTC): Timer1 free running, each stream has its own
+  // compare register moved forward by its period, in counts plus 1/256ths
+  static bool mTimelineRunning;
+  static volatile byte mClockPeriodFraction;
+  static volatile byte mClockFraction;
+  static unsigned int mQuarterFramePeriodCounts;
+  static byte mQuarterFramePeriodFraction;
+  static volatile byte mQuarterFrameFraction;
+  static volatile bool mQuarterFramePending; // Held back to let a clock go first
+  static volatile byte mBeatFlash;  // BeatFlashState
+  static volatile byte mBeatFlashTicksLeft;
+  static volatile uint8_t * mBeatLedPort;
+  static byte mBeatLedMask;
+  static void (* volatile mBeatHandler)(const bool downbeat);
   
   // MTC stuff
   static const SmpteMask mCurrentSmpteType;
   static volatile Playhead mPlayhead;
-  static volatile int mCurrentQFrame;
-  static const MTCQuarterFrameType mMTCQuarterFrameTypes[8];
+  static volatile byte mCurrentQFrame;
+  
+  // Main loop to interrupt mailboxes: the flag is set last, cleared by the interrupt
+  static volatile Playhead mRequestedPlayhead;
+  static volatile bool mPlayheadRequest;
+  static volatile unsigned int mResumePosition;
+  static volatile bool mResumeRequest;
+  static volatile unsigned int mRequestedPrerollSkipTicks;
+  static volatile unsigned int mRequestedPrerollRemainder;
+  static volatile bool mPrerollRequest;
+  static volatile bool mStopRequest;
+  // Incremented by the timer interrupt on entry and exit, see getSongPosition()
+  static volatile byte mSequence;
+  
+  // Timer interrupt output while the main loop writes, see writeMessage()
+  static volatile bool mMainWriting;
+  static byte mTimerRing[MIDI_TIMER_RING_SIZE];
+  static volatile byte mTimerRingHead;  // Written by the interrupt only
+  static volatile byte mTimerRingTail;  // Written by the main loop only
 };
 
 #endif
@@ -0,0 +1,419 @@
+/*                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                      /*
+ MidiClockCtl : MIDI controller (Time Clock) with rotary encoder, 4 digit 7seg display and footswitches.
+ Copyright (C) 2013 Adrien Anselme
+
+ This file is part of MidiClockCtl.
+
+ MidiClockCtl is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 2 of the License, or
+ (at your option) any later version.
+
+ MidiClockCtl is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with MidiClockCtl.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include "mtc_chase.h"
+#include "midi_proxy.h"
+#include "trace.h"
+
+// Share of the difference between extrapolated and received position
+// corrected on each quarter frame (smooths timestamp jitter)
+#define MTC_ANCHOR_GAIN 0.125f
+// Decoded position further than this from the extrapolated one is a jump
+#define MTC_RELOCATE_QUARTER_FRAMES 8
+// Speed estimate limits
+#define MTC_MIN_SPEED 0.5f
+#define MTC_MAX_SPEED 2.0f
+
+// Clock starts when the next 16th note boundary is closer than this
+#define MTC_CHASE_START_WINDOW_US 2000
+// Tempo correction per clock of phase error, and its limit
+#define MTC_CHASE_GAIN 0.005f
+#define MTC_CHASE_MAX_CORRECTION 0.02f
+// Phase error over this restarts playback at the right position
+#define MTC_CHASE_MAX_ERROR_CLOCKS 12
+#define MTC_CHASE_UPDATE_US 50000UL
+
+///////////////////////////////////// MtcReader
+MtcReader::MtcReader()
+: mRate(0), mAnchorQuarterFrames(0), mAnchorFraction(0.0f), mAnchorTime(0),
+  mLockLatencyUs(0), mLastErrorUs(0), mMaxErrorUs(0)
+{
+  reset();
+}
+
+MtcReader::~MtcReader()
+{
+}
+
+void MtcReader::reset()
+{
+  mState = Unlocked;
+  mReceived = 0;
+  mLastIndex = 0xFF; // Nothing in sequence
+  mLastQuarterFrame = 0;
+  mLastTime = 0;
+  mFirstTime = 0;
+  mSpeed = 1.0f;
+  mWindowCount = 0;
+  mWindowPos = 0;
+  mRelocated = false;
+}
+
+void MtcReader::onQuarterFrame(const byte data, const unsigned long now)
+{
+  const byte index = (data >> 4) & 0x07;
+  const bool isFirst = (mLastIndex == 0xFF);
+  const byte step = (index - mLastIndex) & 0x07;
+  
+  // Unlocked or freewheeling: (re)locking starts here
+  if( isFirst )
+    mFirstTime = now;
+  
+  // Pieces only make a frame if received in order
+  if( isFirst || step != 1 )
+    mReceived = 0;
+  mPieces[index] = data & 0x0F;
+  mReceived |= (1 << index);
+  mLastIndex = index;
+  
+  if( (mState == Locking || mState == Locked) && step != 0 )
+  {
+    // Known position: follow it. Quarter frames lost in a short gap are
+    // counted from the time since the last one (index only gives it modulo 8)
+    const float elapsed = (now - mLastTime) * mSpeed / quarterFrameUs();
+    mLastQuarterFrame += step + 8 * max(0L, lround((elapsed - step) / 8));
+    
+    const float predicted = (mAnchorQuarterFrames - mLastQuarterFrame) + mAnchorFraction + extrapolate(now);
+    setAnchor(mLastQuarterFrame, predicted * (1.0f - MTC_ANCHOR_GAIN), now);
+  }
+  mLastTime = now;
+  
+  if( index == 7 && mReceived == 0xFF )
+  {
+    onCompleteFrame(now);
+    mReceived = 0;
+  }
+}
+
+// Last quarter frame of a sequence: decode the frame it started on
+void MtcReader::onCompleteFrame(const unsigned long now)
+{
+  mRate = (mPieces[7] >> 1) & 0x03;
+  const byte frames = mPieces[0] | (mPieces[1] << 4);
+  const byte seconds = mPieces[2] | (mPieces[3] << 4);
+  const byte minutes = mPieces[4] | (mPieces[5] << 4);
+  const byte hours = mPieces[6] | ((mPieces[7] & 0x01) << 4);
+  // Quarter frame 0 came with the frame start, this is the 7th after it
+  const long decoded = toFrames(hours, minutes, seconds, frames) * 4 + 7;
+  
+  if( mState == Unlocked )
+  {
+    setAnchor(decoded, 0.0f, now);
+    mLastQuarterFrame = decoded;
+    mWindowCount = 0;
+    mState = Locking;
+    Trace::recordMain(Trace::MtcState, mState);
+    return;
+  }
+  
+  // Where we thought we are, relative to what was received
+  const float offset = (mAnchorQuarterFrames - decoded) + mAnchorFraction + extrapolate(now);
+  
+  // Quarter frames are not counted while freewheeling
+  const bool hasCount = (mState != Freewheel);
+  if( (hasCount && mLastQuarterFrame != decoded) || fabs(offset) > MTC_RELOCATE_QUARTER_FRAMES )
+  {
+    // Jump: start again from there
+    mRelocated = (mState != Locking);
+    mFirstTime = now;
+    setAnchor(decoded, 0.0f, now);
+    mLastQuarterFrame = decoded;
+    mWindowCount = 0;
+    mSpeed = 1.0f;
+    mState = Locking;
+    Trace::recordMain(Trace::MtcState, mState);
+    return;
+  }
+  
+  mLastErrorUs = -offset * quarterFrameUs();
+  mLastQuarterFrame = decoded;
+  if( mState == Locking )
+    mMaxErrorUs = 0;
+  else
+    mMaxErrorUs = max(mMaxErrorUs, static_cast<unsigned long>(labs(mLastErrorUs)));
+  
+  if( mState != Locked )
+  {
+    // Locked again after a dropout: back on the received position
+    if( !hasCount )
+      setAnchor(decoded, offset * (1.0f - MTC_ANCHOR_GAIN), now);
+    mLockLatencyUs = now - mFirstTime;
+    mState = Locked;
+    Trace::recordMain(Trace::MtcState, mState);
+  }
+  
+  // Speed over the last MTC_SPEED_WINDOW complete frames
+  mWindowQuarterFrames[mWindowPos] = decoded;
+  mWindowTimes[mWindowPos] = now;
+  mWindowPos = (mWindowPos + 1) % MTC_SPEED_WINDOW;
+  if( mWindowCount < MTC_SPEED_WINDOW )
+    ++mWindowCount;
+  
+  if( mWindowCount >= 2 )
+  {
+    const byte oldest = (mWindowPos + MTC_SPEED_WINDOW - mWindowCount) % MTC_SPEED_WINDOW;
+    const unsigned long elapsed = now - mWindowTimes[oldest];
+    if( elapsed > 0 )
+    {
+      const float speed = (decoded - mWindowQuarterFrames[oldest]) * quarterFrameUs() / elapsed;
+      mSpeed = constrain(speed, MTC_MIN_SPEED, MTC_MAX_SPEED);
+    }
+  }
+}
+
+void MtcReader::onFullFrame(const byte hours, const byte minutes, const byte seconds,
+                            const byte frames, const unsigned long now)
+{
+  // Hours byte also carries the rate
+  mRate = (hours >> 5) & 0x03;
+  const long position = toFrames(hours & 0x1F, minutes, seconds, frames) * 4;
+  
+  const bool wasRunning = isRunning();
+  reset();
+  mRelocated = wasRunning;
+  setAnchor(position, 0.0f, now);
+}
+
+void MtcReader::update(const unsigned long now)
+{
+  const unsigned long silence = now - mLastTime;
+  State newState = mState;
+  
+  if( mState == Locked && silence > MTC_DROPOUT_US )
+    newState = Freewheel;
+  else if( mState == Locking && silence > MTC_DROPOUT_US )
+    newState = Unlocked;
+  else if( mState == Freewheel && silence > MTC_FREEWHEEL_US )
+    newState = Unlocked;
+  
+  if( newState == mState )
+    return;
+    
+  if( newState == Unlocked )
+  {
+    // Stopped where freewheeling got to
+    const float position = mAnchorFraction + extrapolate(now);
+    reset();
+    setAnchor(mAnchorQuarterFrames, position, now);
+  }
+  else
+  {
+    // Next quarter frames must first make a complete frame again
+    mLastIndex = 0xFF;
+    mState = newState;
+  }
+  Trace::recordMain(Trace::MtcState, newState);
+}
+
+MtcReader::State MtcReader::getState() const
+{
+  return mState;
+}
+
+bool MtcReader::isRunning() const
+{
+  return mState == Locked || mState == Freewheel;
+}
+
+float MtcReader::getFrameRate() const
+{
+  static const float frameRates[4] = { 24.0f, 25.0f, 30000.0f / 1001.0f, 30.0f };
+  return frameRates[mRate];
+}
+
+float MtcReader::getSpeed() const
+{
+  return mSpeed;
+}
+
+void MtcReader::getPosition(const unsigned long now, long & frames, float & fraction) const
+{
+  float quarterFrames = mAnchorFraction;
+  if( mState != Unlocked )
+    quarterFrames += extrapolate(now);
+  
+  const long whole = mAnchorQuarterFrames + static_cast<long>(floor(quarterFrames));
+  frames = whole >> 2;
+  fraction = ((whole & 0x03) + quarterFrames - floor(quarterFrames)) / 4.0f;
+}
+
+long MtcReader::toFrames(const byte hours, const byte minutes, const byte seconds, const byte frames) const
+{
+  static const byte labelRates[4] = { 24, 25, 30, 30 };
+  const long totalMinutes = hours * 60L + minutes;
+  long count = (totalMinutes * 60 + seconds) * labelRates[mRate] + frames;
+  if( mRate == 2 )
+  {
+    // Drop frame: labels 0 and 1 skipped every minute, except every 10th
+    count -= 2 * (totalMinutes - totalMinutes / 10);
+  }
+  return count;
+}
+
+bool MtcReader::hasRelocated()
+{
+  const bool relocated = mRelocated;
+  mRelocated = false;
+  return relocated;
+}
+
+unsigned long MtcReader::getLockLatencyUs() const
+{
+  return mLockLatencyUs;
+}
+
+long MtcReader::getLastErrorUs() const
+{
+  return mLastErrorUs;
+}
+
+unsigned long MtcReader::getMaxErrorUs() const
+{
+  return mMaxErrorUs;
+}
+
+void MtcReader::setAnchor(const long quarterFrames, const float fraction, const unsigned long now)
+{
+  const float whole = floor(fraction);
+  mAnchorQuarterFrames = quarterFrames + static_cast<long>(whole);
+  mAnchorFraction = fraction - whole;
+  mAnchorTime = now;
+}
+
+float MtcReader::extrapolate(const unsigned long now) const
+{
+  return (now - mAnchorTime) * mSpeed / quarterFrameUs();
+}
+
+float MtcReader::quarterFrameUs() const
+{
+  return 1000000.0f / (getFrameRate() * 4);
+}
+
+///////////////////////////////////// MtcChase
+MtcChase::MtcChase(MtcReader & reader, MidiProxy & midi)
+: mReader(reader), mMidi(midi), mBpm(120.0f), mOutputBpm(0.0f),
+  mRunning(false), mPhaseError(0.0f), mLastTempoUpdate(0)
+{
+  setStartTime(0, 0, 0, 0);
+}
+
+MtcChase::~MtcChase()
+{
+}
+
+void MtcChase::setStartTime(const byte hours, const byte minutes, const byte seconds, const byte frames)
+{
+  mStartTime[0] = hours;
+  mStartTime[1] = minutes;
+  mStartTime[2] = seconds;
+  mStartTime[3] = frames;
+}
+
+void MtcChase::setBpm(const float bpm)
+{
+  mBpm = bpm;
+}
+
+void MtcChase::update(const unsigned long now)
+{
+  mReader.update(now);
+  if( mReader.hasRelocated() && mRunning )
+    stop();
+  
+  if( !mReader.isRunning() )
+  {
+    if( mRunning )
+      stop();
+    return;
+  }
+  
+  const float clocks = songClocks(now);
+  if( !mRunning )
+  {
+    // Slaves still running on the previous position until its Stop is out
+    if( !mMidi.isStopped() )
+      return;
+    
+    // Song Position Pointer has 16th note steps: start on the next one
+    const long next = static_cast<long>(ceil(clocks / 6.0f));
+    const float clockUs = 60000000.0f / (mBpm * mReader.getSpeed() * 24);
+    if( next >= 0 && (next * 6 - clocks) * clockUs <= MTC_CHASE_START_WINDOW_US && start(next) )
+      mLastTempoUpdate = now;
+    return;
+  }
+  
+  mPhaseError = clocks - MidiProxy::getSongClocks();
+  if( fabs(mPhaseError) > MTC_CHASE_MAX_ERROR_CLOCKS )
+  {
+    stop();
+    return;
+  }
+  
+  if( now - mLastTempoUpdate < MTC_CHASE_UPDATE_US )
+    return;
+  mLastTempoUpdate = now;
+  
+  const float correction = constrain(mPhaseError * MTC_CHASE_GAIN, -MTC_CHASE_MAX_CORRECTION, MTC_CHASE_MAX_CORRECTION);
+  const float bpm = mBpm * mReader.getSpeed() * (1.0f + correction);
+  if( fabs(bpm - mOutputBpm) >= 0.01f )
+  {
+    mOutputBpm = bpm;
+    mMidi.setBpm(bpm);
+  }
+}
+
+bool MtcChase::isRunning() const
+{
+  return mRunning;
+}
+
+float MtcChase::getPhaseError() const
+{
+  return mPhaseError;
+}
+
+// Song position in clocks for the timecode at now, negative before the song
+float MtcChase::songClocks(const unsigned long now) const
+{
+  long frames = 0;
+  float fraction = 0.0f;
+  mReader.getPosition(now, frames, fraction);
+  const long startFrames = mReader.toFrames(mStartTime[0], mStartTime[1], mStartTime[2], mStartTime[3]);
+  const float songFrames = (frames - startFrames) + fraction;
+  return songFrames / mReader.getFrameRate() * mBpm * 24 / 60;
+}
+
+bool MtcChase::start(const long sixteenths)
+{
+  mOutputBpm = mBpm * mReader.getSpeed();
+  mMidi.setBpm(mOutputBpm);
+  if( !mMidi.resumeClock(sixteenths) )
+    return false;
+  mRunning = true;
+  mPhaseError = 0.0f;
+  return true;
+}
+
+// Timecode stopped or jumped: not waiting for a quantize boundary
+void MtcChase::stop()
+{
+  mMidi.stopNow();
+  mRunning = false;
+}
@@ -0,0 +1,156 @@
+/*                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                      /*
+ MidiClockCtl : MIDI controller (Time Clock) with rotary encoder, 4 digit 7seg display and footswitches.
+ Copyright (C) 2013 Adrien Anselme
+
+ This file is part of MidiClockCtl.
+
+ MidiClockCtl is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 2 of the License, or
+ (at your option) any later version.
+
+ MidiClockCtl is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with MidiClockCtl.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef _MIDI_CLOCK_CTL_MTC_CHASE_H_
+#define _MIDI_CLOCK_CTL_MTC_CHASE_H_
+
+#include <Arduino.h>
+
+class MidiProxy;
+
+// No quarter frame for this long: freewheel on the estimated speed...
+#define MTC_DROPOUT_US 100000UL
+// ...and stop after this long
+#define MTC_FREEWHEEL_US 2000000UL
+// Quarter frames averaged for the speed estimate, in groups of 8
+#define MTC_SPEED_WINDOW 8
+
+/////////////////////////////////////
+// Reads incoming MTC: quarter frames and full frame messages make a playhead,
+// extrapolated between messages from the measured frame rate and speed.
+// Timestamps are given by the caller (micros() in the main loop), so the
+// reader can be run against recorded or synthesized timecode.
+class MtcReader
+{
+public:
+  enum State
+  {
+    Unlocked = 0,
+    Locking,      ///< Position known, waiting for a second complete frame to confirm
+    Locked,
+    Freewheel     ///< Timecode lost, position still running at the last speed
+  };
+  
+  MtcReader();
+  ~MtcReader();
+  
+  void reset();
+  
+  /// Data byte of an F1 message
+  void onQuarterFrame(const byte data, const unsigned long now);
+  /// F0 7F cc 01 01 hr mn sc fr F7: relocation, quarter frames follow when running.
+  /// Hours as received, rate in bits 5-6
+  void onFullFrame(const byte hours, const byte minutes, const byte seconds,
+                   const byte frames, const unsigned long now);
+  /// Handles dropouts. To be called regularly
+  void update(const unsigned long now);
+  
+  State getState() const;
+  /// Locked or freewheeling
+  bool isRunning() const;
+  
+  /// Frames per second from the incoming rate bits (29.97 for drop frame)
+  float getFrameRate() const;
+  /// Playback speed, 1.0 at nominal rate
+  float getSpeed() const;
+  /// Real time frame count, for the timecode at now (drop frames accounted for).
+  /// Split in whole frames and fraction to keep precision on long timecodes
+  void getPosition(const unsigned long now, long & frames, float & fraction) const;
+  /// Frame count of a timecode at the current rate
+  long toFrames(const byte hours, const byte minutes, const byte seconds, const byte frames) const;
+  
+  /// True once after the timecode jumped
+  bool hasRelocated();
+  
+  /// Measurements: time from the first quarter frame to lock, and error between
+  /// decoded and extrapolated position when frames complete (loop jitter included)
+  unsigned long getLockLatencyUs() const;
+  long getLastErrorUs() const;
+  unsigned long getMaxErrorUs() const;
+  
+private:
+  void onCompleteFrame(const unsigned long now);
+  void setAnchor(const long quarterFrames, const float fraction, const unsigned long now);
+  float extrapolate(const unsigned long now) const; // Quarter frames since anchor
+  float quarterFrameUs() const;
+  
+private:
+  State mState;
+  byte mRate;                   // SMPTE rate bits
+  byte mPieces[8];              // Nibbles of the quarter frames being assembled
+  byte mReceived;               // Bit per quarter frame index received in sequence
+  byte mLastIndex;
+  long mLastQuarterFrame;       // Position of the last quarter frame received, in quarter frames
+  unsigned long mLastTime;
+  unsigned long mFirstTime;     // First quarter frame since unlocked
+  
+  long mAnchorQuarterFrames;    // Position at mAnchorTime, in quarter frames...
+  float mAnchorFraction;        // ...plus this
+  unsigned long mAnchorTime;
+  float mSpeed;
+  
+  long mWindowQuarterFrames[MTC_SPEED_WINDOW];
+  unsigned long mWindowTimes[MTC_SPEED_WINDOW];
+  byte mWindowCount;
+  byte mWindowPos;
+  
+  bool mRelocated;
+  unsigned long mLockLatencyUs;
+  long mLastErrorUs;
+  unsigned long mMaxErrorUs;
+};
+
+/////////////////////////////////////
+// Drives the MIDI clock from an MtcReader: song position follows the
+// timecode at the song tempo, starting at a given timecode.
+class MtcChase
+{
+public:
+  MtcChase(MtcReader & reader, MidiProxy & midi);
+  ~MtcChase();
+  
+  /// Timecode of the start of the song
+  void setStartTime(const byte hours, const byte minutes, const byte seconds, const byte frames);
+  /// Song tempo at nominal timecode speed
+  void setBpm(const float bpm);
+  
+  /// To be called in main loop function
+  void update(const unsigned long now);
+  
+  bool isRunning() const;
+  /// Last difference between timecode and clocks sent, in clocks
+  float getPhaseError() const;
+  
+private:
+  float songClocks(const unsigned long now) const;
+  bool start(const long sixteenths);
+  void stop();
+  
+private:
+  MtcReader & mReader;
+  MidiProxy & mMidi;
+  byte mStartTime[4];
+  float mBpm;
+  float mOutputBpm;
+  bool mRunning;
+  float mPhaseError;
+  unsigned long mLastTempoUpdate;
+};
+
+#endif
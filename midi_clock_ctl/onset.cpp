@@ -0,0 +1,226 @@
+/*                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                      /*
+ MidiClockCtl : MIDI controller (Time Clock) with rotary encoder, 4 digit 7seg display and footswitches.
+ Copyright (C) 2013 Adrien Anselme
+
+ This file is part of MidiClockCtl.
+
+ MidiClockCtl is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 2 of the License, or
+ (at your option) any later version.
+
+ MidiClockCtl is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with MidiClockCtl.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include "onset.h"
+
+// Smoothing, as shifts: new = old + (target - old) >> shift
+#define ONSET_DC_SHIFT 7       // ~0.25 s
+#define ONSET_ATTACK_SHIFT 1
+#define ONSET_RELEASE_SHIFT 4  // ~30 ms
+#define ONSET_AVERAGE_SHIFT 7  // ~0.25 s
+// Onset when the envelope goes over twice its average plus this (16x ADC units)
+#define ONSET_MIN_LEVEL (20 * 16)
+// No two onsets within 100 ms (max 600 BPM)
+#define ONSET_REFRACTORY_SAMPLES 49
+
+// Intervals longer than this restart the estimation
+#define TEMPO_TIMEOUT_S 3
+// Intervals agreeing within this ratio of the median make a tempo
+#define TEMPO_TOLERANCE 0.04f
+#define TEMPO_MIN_AGREEING 4
+
+///////////////////////////////////// OnsetDetector
+OnsetDetector::OnsetDetector()
+{
+  reset();
+}
+
+void OnsetDetector::reset()
+{
+  mDcLevel = 512 * 16;
+  mEnvelope = 0;
+  mAverage = 0;
+  mRefractory = 0;
+  mArmed = true;
+}
+
+bool OnsetDetector::process(const int sample)
+{
+  const unsigned int input = sample * 16;
+  
+  // Remove DC, full wave rectify
+  if( input > mDcLevel )
+    mDcLevel += (input - mDcLevel) >> ONSET_DC_SHIFT;
+  else
+    mDcLevel -= (mDcLevel - input) >> ONSET_DC_SHIFT;
+  const unsigned int rectified = (input > mDcLevel) ? input - mDcLevel : mDcLevel - input;
+  
+  // Envelope follower
+  if( rectified > mEnvelope )
+    mEnvelope += (rectified - mEnvelope) >> ONSET_ATTACK_SHIFT;
+  else
+    mEnvelope -= (mEnvelope - rectified) >> ONSET_RELEASE_SHIFT;
+    
+  // Adaptive threshold
+  if( mEnvelope > mAverage )
+    mAverage += (mEnvelope - mAverage) >> ONSET_AVERAGE_SHIFT;
+  else
+    mAverage -= (mAverage - mEnvelope) >> ONSET_AVERAGE_SHIFT;
+  
+  // Max 2 * 16368 + 320, fits 16 bits
+  const unsigned int threshold = 2 * mAverage + ONSET_MIN_LEVEL;
+  
+  if( mRefractory > 0 )
+    --mRefractory;
+  
+  if( !mArmed )
+  {
+    // Wait for the previous hit to decay before accepting another one
+    if( mEnvelope < threshold - (threshold >> 2) )
+      mArmed = true;
+    return false;
+  }
+  
+  if( mEnvelope > threshold && mRefractory == 0 )
+  {
+    mArmed = false;
+    mRefractory = ONSET_REFRACTORY_SAMPLES;
+    return true;
+  }
+  return false;
+}
+
+///////////////////////////////////// TempoEstimator
+TempoEstimator::TempoEstimator(const float sampleRate)
+: mSampleRate(sampleRate), mMinBpm(80.0f)
+{
+  reset();
+}
+
+void TempoEstimator::reset()
+{
+  mHasLastOnset = false;
+  mLastOnset = 0;
+  mCount = 0;
+  mPos = 0;
+}
+
+void TempoEstimator::setMinBpm(const float minBpm)
+{
+  mMinBpm = minBpm;
+  reset();
+}
+
+float TempoEstimator::onset(const unsigned long sampleIndex)
+{
+  const unsigned long interval = sampleIndex - mLastOnset;
+  const bool hadLastOnset = mHasLastOnset;
+  mHasLastOnset = true;
+  mLastOnset = sampleIndex;
+  
+  if( !hadLastOnset || interval == 0 )
+    return 0.0f;
+    
+  if( interval > TEMPO_TIMEOUT_S * mSampleRate )
+  {
+    // Band stopped playing: start again
+    mCount = 0;
+    return 0.0f;
+  }
+  
+  float bpm = 60.0f * mSampleRate / interval;
+  while( bpm < mMinBpm )
+    bpm *= 2.0f;
+  while( bpm >= 2.0f * mMinBpm )
+    bpm /= 2.0f;
+    
+  mBpms[mPos] = bpm;
+  mPos = (mPos + 1) % TEMPO_NUM_INTERVALS;
+  if( mCount < TEMPO_NUM_INTERVALS )
+    ++mCount;
+  
+  if( mCount < TEMPO_MIN_AGREEING )
+    return 0.0f;
+    
+  // Average the intervals close to the median, if there are enough of them
+  const float center = median();
+  float sum = 0.0f;
+  byte agreeing = 0;
+  for( byte i = 0; i < mCount; ++i )
+  {
+    if( fabs(mBpms[i] - center) <= center * TEMPO_TOLERANCE )
+    {
+      sum += mBpms[i];
+      ++agreeing;
+    }
+  }
+  
+  if( agreeing < TEMPO_MIN_AGREEING )
+    return 0.0f;
+  return sum / agreeing;
+}
+
+float TempoEstimator::median() const
+{
+  float sorted[TEMPO_NUM_INTERVALS];
+  for( byte i = 0; i < mCount; ++i )
+  {
+    // Insertion sort, at most TEMPO_NUM_INTERVALS values
+    byte j = i;
+    for( ; j > 0 && sorted[j - 1] > mBpms[i]; --j )
+      sorted[j] = sorted[j - 1];
+    sorted[j] = mBpms[i];
+  }
+  return sorted[mCount / 2];
+}
+
+///////////////////////////////////// AutoTempo
+AutoTempo::AutoTempo()
+: mEstimator(ONSET_SAMPLE_RATE), mLastOnsetCount(0)
+{
+}
+
+AutoTempo::~AutoTempo()
+{
+}
+
+// Called from the ADC interrupt for every sample of the auto tempo input
+void AutoTempo::doSample(const int sample)
+{
+  ++mSampleCount;
+  if( mDetector.process(sample) )
+  {
+    mLastOnsetSample = mSampleCount;
+    ++mOnsetCount;
+  }
+}
+
+const float AutoTempo::update()
+{
+  byte onsetCount = mOnsetCount;
+  if( onsetCount == mLastOnsetCount )
+    return 0.0f;
+  
+  // Multi-byte value changed by the interrupt: read until no onset came in between
+  unsigned long onsetSample = 0;
+  do
+  {
+    onsetCount = mOnsetCount;
+    onsetSample = mLastOnsetSample;
+  }
+  while( onsetCount != mOnsetCount );
+  
+  mLastOnsetCount = onsetCount;
+  return mEstimator.onset(onsetSample);
+}
+
+OnsetDetector AutoTempo::mDetector;
+volatile unsigned long AutoTempo::mSampleCount = 0;
+volatile unsigned long AutoTempo::mLastOnsetSample = 0;
+volatile byte AutoTempo::mOnsetCount = 0;
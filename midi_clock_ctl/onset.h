@@ -0,0 +1,108 @@
+/*                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                      /*
+ MidiClockCtl : MIDI controller (Time Clock) with rotary encoder, 4 digit 7seg display and footswitches.
+ Copyright (C) 2013 Adrien Anselme
+
+ This file is part of MidiClockCtl.
+
+ MidiClockCtl is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 2 of the License, or
+ (at your option) any later version.
+
+ MidiClockCtl is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with MidiClockCtl.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef _MIDI_CLOCK_CTL_ONSET_H_
+#define _MIDI_CLOCK_CTL_ONSET_H_
+
+#include <Arduino.h>
+
+// Rate of the auto tempo input: Timer0 overflow (16 MHz / 64 / 256)
+// shared by the selector and the auto tempo input, see Controls
+#define ONSET_SAMPLE_RATE 488.28125f
+
+// Number of inter-onset intervals the tempo is estimated on
+#define TEMPO_NUM_INTERVALS 8
+
+/////////////////////////////////////
+// Kick drum onsets in a 10 bit ADC signal (piezo or DC-biased line input).
+// Fixed point, constant cost per sample: safe to run in the ADC interrupt.
+class OnsetDetector
+{
+public:
+  OnsetDetector();
+
+  void reset();
+  
+  /// Returns true when sample starts a new onset
+  bool process(const int sample);
+  
+private:
+  unsigned int mDcLevel;    // 16x input DC level
+  unsigned int mEnvelope;   // 16x rectified signal envelope, fast attack, slower release
+  unsigned int mAverage;    // 16x slow envelope average, the adaptive threshold base
+  unsigned int mRefractory; // samples left before another onset is accepted
+  bool mArmed;              // envelope went back down since last onset
+};
+
+/////////////////////////////////////
+// Tempo from inter-onset intervals, folded into one octave of BPM so
+// kicks on every beat or every other beat give the same tempo.
+class TempoEstimator
+{
+public:
+  TempoEstimator(const float sampleRate);
+
+  void reset();
+  
+  /// Lowest tempo reported, intervals are folded into [minBpm, 2 * minBpm)
+  void setMinBpm(const float minBpm);
+  
+  /// Onset at sampleIndex. Returns the tempo once the last intervals agree, 0 otherwise
+  float onset(const unsigned long sampleIndex);
+  
+private:
+  float median() const;
+  
+private:
+  const float mSampleRate;
+  float mMinBpm;
+  bool mHasLastOnset;
+  unsigned long mLastOnset;
+  byte mCount;
+  byte mPos;
+  float mBpms[TEMPO_NUM_INTERVALS];
+};
+
+/////////////////////////////////////
+// Detector fed by the ADC interrupt (see Controls::setAuxInput),
+// tempo estimated in the main loop.
+class AutoTempo
+{
+public:
+  AutoTempo();
+  ~AutoTempo();
+
+  /// New tempo once onsets are regular enough, 0 otherwise.
+  /// To be called in main loop function
+  const float update();
+
+  static void doSample(const int sample);
+  
+private:
+  TempoEstimator mEstimator;
+  byte mLastOnsetCount;
+  
+  // Note:  all variables changed within interrupts are volatile
+  static OnsetDetector mDetector;
+  static volatile unsigned long mSampleCount;
+  static volatile unsigned long mLastOnsetSample;
+  static volatile byte mOnsetCount; // Changes on every onset, lets the main loop spot a new one
+};
+
+#endif
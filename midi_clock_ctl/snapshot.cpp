@@ -0,0 +1,104 @@
+/*                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                      /*
+ MidiClockCtl : MIDI controller (Time Clock) with rotary encoder, 4 digit 7seg display and footswitches.
+ Copyright (C) 2013 Adrien Anselme
+
+ This file is part of MidiClockCtl.
+
+ MidiClockCtl is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 2 of the License, or
+ (at your option) any later version.
+
+ MidiClockCtl is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with MidiClockCtl.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include "snapshot.h"
+#include "eeprom_queue.h"
+
+SnapshotStore::SnapshotStore(const int eepromAddress)
+: mEepromAddress(eepromAddress), mNextSlot(0), mNextSequence(0), mPending(false)
+{
+}
+
+SnapshotStore::~SnapshotStore()
+{
+}
+
+bool SnapshotStore::restore(Snapshot & snapshot)
+{
+  bool found = false;
+  byte newestSequence = 0;
+  byte newestSlot = 0;
+  byte slotData[SlotSize];
+  
+  for( byte slot = 0; slot < SNAPSHOT_SLOTS; ++slot )
+  {
+    const int address = slotAddress(slot);
+    for( byte i = 0; i < SlotSize; ++i )
+      slotData[i] = EepromQueue::read(address + i);
+    
+    if( checksum(slotData, SlotData) != slotData[SlotData] )
+      continue;
+      
+    // Sequence numbers of valid slots are within SNAPSHOT_SLOTS of each other
+    const byte sequence = slotData[0];
+    if( !found || static_cast<int8_t>(sequence - newestSequence) > 0 )
+    {
+      found = true;
+      newestSequence = sequence;
+      newestSlot = slot;
+      memcpy(&snapshot, slotData + 1, sizeof(Snapshot));
+    }
+  }
+  
+  if( found )
+  {
+    mNextSlot = (newestSlot + 1) % SNAPSHOT_SLOTS;
+    mNextSequence = newestSequence + 1;
+  }
+  return found;
+}
+
+void SnapshotStore::save(const Snapshot & snapshot)
+{
+  mPendingSnapshot = snapshot;
+  mPending = true;
+  update();
+}
+
+void SnapshotStore::update()
+{
+  if( !mPending )
+    return;
+  
+  // Whole slot at once, checksum last: the queue keeps the order
+  byte slotData[SlotSize];
+  slotData[0] = mNextSequence;
+  memcpy(slotData + 1, &mPendingSnapshot, sizeof(Snapshot));
+  slotData[SlotData] = checksum(slotData, SlotData);
+  if( !EepromQueue::write(slotAddress(mNextSlot), slotData, SlotSize) )
+    return; // Previous slot still being written
+  
+  mPending = false;
+  mNextSlot = (mNextSlot + 1) % SNAPSHOT_SLOTS;
+  ++mNextSequence;
+}
+
+const int SnapshotStore::slotAddress(const byte slot) const
+{
+  return mEepromAddress + slot * SlotSize;
+}
+
+// Erased EEPROM (all 0xFF) must not pass
+const byte SnapshotStore::checksum(const byte * data, const byte length)
+{
+  byte sum = 0x5A;
+  for( byte i = 0; i < length; ++i )
+    sum = ((sum << 1) | (sum >> 7)) ^ data[i];
+  return sum;
+}
@@ -0,0 +1,84 @@
+/*                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                      /*
+ MidiClockCtl : MIDI controller (Time Clock) with rotary encoder, 4 digit 7seg display and footswitches.
+ Copyright (C) 2013 Adrien Anselme
+
+ This file is part of MidiClockCtl.
+
+ MidiClockCtl is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 2 of the License, or
+ (at your option) any later version.
+
+ MidiClockCtl is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with MidiClockCtl.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef _MIDI_CLOCK_CTL_SNAPSHOT_H_
+#define _MIDI_CLOCK_CTL_SNAPSHOT_H_
+
+#include <Arduino.h>
+
+// Snapshots are written in turn to this many slots, for wear leveling: the
+// rest of the 1 KB EEPROM after the sketch's EEPROM_SNAPSHOT_ADDR (16).
+// Less than 128, sequence numbers are compared as signed byte differences
+#define SNAPSHOT_SLOTS 84
+
+/////////////////////////////////////
+// Runtime state restored at power on
+struct Snapshot
+{
+  byte mode;                  // MidiProxy::MidiSynchro
+  byte playing;
+  unsigned int bpmTen;
+  unsigned int songPosition;  // Clock mode, in MIDI beats (16th notes)
+  byte hours;                 // MTC mode
+  byte minutes;
+  byte seconds;
+  byte frames;
+};
+
+/////////////////////////////////////
+// Ring of snapshots in EEPROM. Each slot holds a sequence number and a
+// checksum: the newest valid slot is the last complete snapshot, even if
+// power went away in the middle of a write.
+// Writes never wait on the EEPROM: slots go through EepromQueue, and a
+// snapshot saved while the queue is full is queued by a later update().
+class SnapshotStore
+{
+public:
+  SnapshotStore(const int eepromAddress);
+  ~SnapshotStore();
+
+  /// Newest valid snapshot, false if there is none. Only reads, fast enough for boot
+  bool restore(Snapshot & snapshot);
+  
+  /// Queues snapshot for the next slot. If the queue is full, only the
+  /// latest snapshot saved is written once there is room.
+  void save(const Snapshot & snapshot);
+  
+  /// To be called in main loop function
+  void update();
+  
+private:
+  static const byte checksum(const byte * data, const byte length);
+  const int slotAddress(const byte slot) const;
+  
+private:
+  enum
+  {
+    SlotData = sizeof(Snapshot) + 1,  // Sequence number first
+    SlotSize = SlotData + 1           // Then checksum
+  };
+  
+  const int mEepromAddress;
+  byte mNextSlot;
+  byte mNextSequence;
+  bool mPending;
+  Snapshot mPendingSnapshot;
+};
+
+#endif
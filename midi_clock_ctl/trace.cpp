@@ -0,0 +1,158 @@
+/*                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                      /*
+ MidiClockCtl : MIDI controller (Time Clock) with rotary encoder, 4 digit 7seg display and footswitches.
+ Copyright (C) 2013 Adrien Anselme
+
+ This file is part of MidiClockCtl.
+
+ MidiClockCtl is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 2 of the License, or
+ (at your option) any later version.
+
+ MidiClockCtl is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with MidiClockCtl.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include "trace.h"
+#include "midi_proxy.h"
+
+#define TRACE_CONTEXT_ISR 0x00
+#define TRACE_CONTEXT_MAIN 0x01
+#define TRACE_DUMP_REQUEST 0x00
+#define TRACE_DUMP_END 0x7F
+#define TRACE_RECORD_LENGTH 14
+#define TRACE_TIME_MASK 0xFFFFFFUL
+
+bool Trace::isDumpRequest(const byte * message, const byte length)
+{
+  return length == 5 && message[0] == 0xF0 && message[1] == 0x7D
+      && message[2] == TRACE_SYSEX_ID && message[3] == TRACE_DUMP_REQUEST && message[4] == 0xF7;
+}
+
+#if TRACE_ENABLED
+
+void Trace::requestDump()
+{
+  if( mFrozen )
+    return;
+  
+  // Interrupt handlers are never interrupted by the main loop: once the
+  // flag is set, no record is half written and the rings can be read freely
+  mFrozen = true;
+  Record now;
+  timestamp(now.overflows, now.ticks);
+  mFreezeTime = recordTime(now);
+  mIsrDumped = 0;
+  mMainDumped = 0;
+}
+
+void Trace::update()
+{
+  if( !mFrozen )
+    return;
+    
+  if( Serial.availableForWrite() < TRACE_RECORD_LENGTH )
+    return;
+  
+  // Merge both rings, oldest first: age relative to the dump request
+  // (timestamps wrap, but the order holds within 67 s)
+  byte isrDumped = mIsrDumped;
+  byte mainDumped = mMainDumped;
+  const Record * isrNext = nextToDump(mIsrRecords, mIsrPos, isrDumped);
+  const Record * mainNext = nextToDump(mMainRecords, mMainPos, mainDumped);
+  
+  if( isrNext == 0 && mainNext == 0 )
+  {
+    byte message[5];
+    message[0] = 0xF0;
+    message[1] = 0x7D;
+    message[2] = TRACE_SYSEX_ID;
+    message[3] = TRACE_DUMP_END;
+    message[4] = 0xF7;
+    MidiProxy::writeMessage(message, 5);
+    // Dumped records must not come back in the next dump
+    clear(mIsrRecords);
+    clear(mMainRecords);
+    mFrozen = false;
+    return;
+  }
+  
+  const bool isrFirst = (mainNext == 0)
+    || (isrNext != 0 && ((mFreezeTime - recordTime(*isrNext)) & TRACE_TIME_MASK)
+                        >= ((mFreezeTime - recordTime(*mainNext)) & TRACE_TIME_MASK));
+  if( isrFirst )
+  {
+    sendRecord(TRACE_CONTEXT_ISR, *isrNext);
+    mIsrDumped = isrDumped + 1;
+  }
+  else
+  {
+    sendRecord(TRACE_CONTEXT_MAIN, *mainNext);
+    mMainDumped = mainDumped + 1;
+  }
+}
+
+// Oldest record of a ring not dumped yet, 0 when done. Skips unused slots
+const Trace::Record * Trace::nextToDump(const Record * records, const byte pos, byte & dumped)
+{
+  for( ; dumped < TRACE_SIZE; ++dumped )
+  {
+    // Oldest record is the one about to be overwritten
+    const Record & r = records[(pos + dumped) & (TRACE_SIZE - 1)];
+    if( r.event != NoEvent )
+      return &r;
+  }
+  return 0;
+}
+
+void Trace::sendRecord(const byte context, const Record & r)
+{
+  byte message[TRACE_RECORD_LENGTH];
+  message[0] = 0xF0;
+  message[1] = 0x7D;
+  message[2] = TRACE_SYSEX_ID;
+  message[3] = context;
+  message[4] = r.event;
+  message[5] = r.data >> 4;
+  message[6] = r.data & 0x0F;
+  message[7] = r.overflows >> 12;
+  message[8] = (r.overflows >> 8) & 0x0F;
+  message[9] = (r.overflows >> 4) & 0x0F;
+  message[10] = r.overflows & 0x0F;
+  message[11] = r.ticks >> 4;
+  message[12] = r.ticks & 0x0F;
+  message[13] = 0xF7;
+  MidiProxy::writeMessage(message, TRACE_RECORD_LENGTH);
+}
+
+// Main loop only, with recording stopped
+void Trace::clear(Record * records)
+{
+  for( byte i = 0; i < TRACE_SIZE; ++i )
+    records[i].event = NoEvent;
+}
+
+Trace::Record Trace::mIsrRecords[TRACE_SIZE];
+volatile byte Trace::mIsrPos = 0;
+Trace::Record Trace::mMainRecords[TRACE_SIZE];
+volatile byte Trace::mMainPos = 0;
+volatile bool Trace::mFrozen = false;
+unsigned long Trace::mFreezeTime = 0;
+byte Trace::mIsrDumped = 0;
+byte Trace::mMainDumped = 0;
+
+#else
+
+void Trace::requestDump()
+{
+}
+
+void Trace::update()
+{
+}
+
+#endif
@@ -0,0 +1,155 @@
+/*                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                      /*
+ MidiClockCtl : MIDI controller (Time Clock) with rotary encoder, 4 digit 7seg display and footswitches.
+ Copyright (C) 2013 Adrien Anselme
+
+ This file is part of MidiClockCtl.
+
+ MidiClockCtl is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 2 of the License, or
+ (at your option) any later version.
+
+ MidiClockCtl is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with MidiClockCtl.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef _MIDI_CLOCK_CTL_TRACE_H_
+#define _MIDI_CLOCK_CTL_TRACE_H_
+
+#include <Arduino.h>
+
+// Records output bytes and input events for post-mortem timing analysis.
+// Costs 2 * TRACE_SIZE * 5 bytes of RAM, so off by default.
+#ifndef TRACE_ENABLED
+#define TRACE_ENABLED 0
+#endif
+// Records kept per context (interrupts, main loop), power of 2
+#define TRACE_SIZE 32
+// Dump SysEx: F0 7D <TRACE_SYSEX_ID> ... F7 (7D: non-commercial manufacturer ID)
+#define TRACE_SYSEX_ID 0x54
+
+#if TRACE_ENABLED
+// Timer0 overflow count, maintained by the Arduino core for millis()
+extern volatile unsigned long timer0_overflow_count;
+#endif
+
+/////////////////////////////////////
+// Two rings of (timestamp, event, data) records: one written by interrupt
+// handlers only (they don't nest), one by the main loop only. Each has a
+// single writer, so recording needs no locking. Recording stops while the
+// rings are dumped, oldest record first, as one SysEx message per record:
+//   F0 7D 54 <context> <event> <data, 2 nibbles> <time, 6 nibbles> F7
+// followed by F0 7D 54 7F F7. Context is 0 for interrupts, 1 for the main
+// loop. Time is micros() in 4 us units, 24 bits: it wraps every 67 s, and
+// records are ordered by their age at the dump request.
+// A dump is requested with requestDump() or by receiving F0 7D 54 00 F7.
+class Trace
+{
+public:
+  enum Event
+  {
+    NoEvent         = 0x00,
+    OutputByte      = 0x01,   ///< Byte written to MIDI out
+    EncoderTurn     = 0x02,   ///< 1 clockwise, 0xFF counter clockwise
+    ButtonPress     = 0x03,   ///< Button number, 0x80 set for long presses
+    SelectorChange  = 0x04,   ///< New Controls::SelectorMode
+    MtcState        = 0x05    ///< New MtcReader::State of the incoming timecode
+  };
+  
+  /// For interrupt handlers only
+  static inline void recordIsr(const byte event, const byte data)
+  {
+#if TRACE_ENABLED
+    if( !mFrozen )
+      record(mIsrRecords, mIsrPos, event, data);
+#else
+    (void)event;
+    (void)data;
+#endif
+  }
+  
+  /// For the main loop only
+  static inline void recordMain(const byte event, const byte data)
+  {
+#if TRACE_ENABLED
+    if( !mFrozen )
+      record(mMainRecords, mMainPos, event, data);
+#else
+    (void)event;
+    (void)data;
+#endif
+  }
+  
+  /// Stops recording and starts the dump. Recording resumes once it is over
+  static void requestDump();
+  
+  /// True for the SysEx dump request, to be kept off MIDI out
+  static bool isDumpRequest(const byte * message, const byte length);
+  
+  /// Sends the next record of a dump when the serial buffer has room for it.
+  /// To be called in main loop function
+  static void update();
+  
+private:
+  // 24 bit time: Timer0 overflows (low 16 bits) and counter
+  struct Record
+  {
+    unsigned int overflows;
+    byte ticks;
+    byte event;
+    byte data;
+  };
+  
+#if TRACE_ENABLED
+  static inline void record(Record * records, volatile byte & pos, const byte event, const byte data)
+  {
+    Record & r = records[pos];
+    timestamp(r.overflows, r.ticks);
+    r.event = event;
+    r.data = data;
+    pos = (pos + 1) & (TRACE_SIZE - 1);
+  }
+  
+  // Same as micros() in 4 us units, without masking interrupts: read again
+  // if the overflow interrupt ran in the middle. In an interrupt handler it
+  // can't, and a pending overflow is accounted for like micros() does
+  static inline void timestamp(unsigned int & overflows, byte & ticks)
+  {
+    bool pending;
+    do
+    {
+      overflows = timer0_overflow_count;
+      ticks = TCNT0;
+      pending = (TIFR0 & _BV(TOV0)) && ticks < 255;
+    } while( overflows != static_cast<unsigned int>(timer0_overflow_count) );
+    if( pending )
+      ++overflows;
+  }
+  
+  static inline unsigned long recordTime(const Record & r)
+  {
+    return (static_cast<unsigned long>(r.overflows) << 8) | r.ticks;
+  }
+  
+  static const Record * nextToDump(const Record * records, const byte pos, byte & dumped);
+  static void sendRecord(const byte context, const Record & r);
+  static void clear(Record * records);
+  
+private:
+  // Note:  all variables changed within interrupts are volatile
+  static Record mIsrRecords[TRACE_SIZE];
+  static volatile byte mIsrPos;
+  static Record mMainRecords[TRACE_SIZE];
+  static volatile byte mMainPos;
+  static volatile bool mFrozen;
+  static unsigned long mFreezeTime;
+  static byte mIsrDumped;   // Records of each ring already looked at by the dump
+  static byte mMainDumped;
+#endif
+};
+
+#endif
@@ -0,0 +1,39 @@
+#!/bin/sh
+# Static RAM (.data + .bss) report per module, checked against the budget.
+#
+# Usage: tools/ram_report.sh <build dir> [budget in bytes]
+#   <build dir> is the --build-path given to arduino-cli compile.
+#   Exits with an error if the linked firmware goes over budget.
+
+BUILD_DIR=${1:?"usage: $0 <build dir> [budget in bytes]"}
+RAM_BUDGET=${2:-1536}
+AVR_SIZE=${AVR_SIZE:-avr-size}
+
+ELF=$(ls "$BUILD_DIR"/*.elf 2>/dev/null | head -n 1)
+if [ -z "$ELF" ]; then
+  echo "No firmware found in $BUILD_DIR" >&2
+  exit 2
+fi
+
+printf "%-32s %6s %6s %6s\n" "module" "data" "bss" "ram"
+
+# Sketch modules, then core and libraries (HardwareSerial buffers show up there)
+for OBJ in "$BUILD_DIR"/sketch/*.o; do
+  "$AVR_SIZE" "$OBJ"
+done | awk 'NR > 1 && $1 != "text" {
+  name = $6; sub(/.*\//, "", name);
+  printf "%-32s %6d %6d %6d\n", name, $2, $3, $2 + $3 }'
+
+for ARCHIVE in "$BUILD_DIR"/core/core.a "$BUILD_DIR"/libraries/*/*.o; do
+  [ -f "$ARCHIVE" ] && "$AVR_SIZE" "$ARCHIVE"
+done | awk '$1 != "text" && ($2 + $3) > 0 {
+  name = $6; sub(/.*\//, "", name);
+  printf "%-32s %6d %6d %6d\n", name, $2, $3, $2 + $3 }'
+
+TOTAL=$("$AVR_SIZE" "$ELF" | awk 'NR == 2 { print $2 + $3 }')
+printf "%-32s %20d (budget %d)\n" "total" "$TOTAL" "$RAM_BUDGET"
+
+if [ "$TOTAL" -gt "$RAM_BUDGET" ]; then
+  echo "Static RAM over budget by $((TOTAL - RAM_BUDGET)) bytes" >&2
+  exit 1
+fi